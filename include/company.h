@@ -2,7 +2,9 @@
 #define COMPANY_H
 
 #include "daemon.h"
-#include <sys/msg.h>
+#include "event_ring.h"
+#include "storage.h"
+#include "trace.h"
 #include <dirent.h>
 #include <pwd.h>
 
@@ -15,27 +17,98 @@
 #define ERROR_LOG       "/var/company/logs/errors.log"
 #define LOCK_FILE       "/var/run/company_daemon.lock"
 #define PID_FILE        "/var/run/company_daemon.pid"
+#define STATE_FILE      "/var/run/company_daemon.state"
+
+// Reports are published in generations, REPORTING_DIR/gen-NNNNNN, and
+// REPORTING_DIR/current is a symlink to the newest one. A published
+// generation and its reports (REPORT_MODE) are never modified; unchanged
+// reports are hard links shared with the previous generation.
+//
+// Readers resolve current, open the generation and take flock(LOCK_SH)
+// on it for as long as they read. The daemon may have started to reclaim
+// the generation between the open and the lock, so once the lock is held
+// a reader must check that the generation is still in place: fstat() on
+// the directory shows st_nlink == 0 once it has been removed, and current
+// no longer names it once it may be reclaimed. If either check fails the
+// reader closes it and resolves current again. reporting_open_snapshot()
+// does this for the daemon itself.
+#define REPORTING_CURRENT   "current"
+#define GENERATION_PREFIX   "gen-"
+#define REPORT_MODE         0444
+
+// Times a reader resolves current before giving up
+#define SNAPSHOT_OPEN_ATTEMPTS  16
+
+// Environment variable carrying the readiness pipe from company_control
+#define NOTIFY_FD_ENV   "COMPANY_NOTIFY_FD"
+
+// Environment variable selecting the storage backend (default "posix")
+#define STORAGE_ENV     "COMPANY_STORAGE"
+
+// Daily report index: the header elements recorded for each report and
+// how far into the report they are looked for
+#define INDEX_DIR           "/var/company/index"
+#define INDEX_FIELDS        "date,department,author,title"
+#define INDEX_HEADER_BYTES  4096
+
+// Environment variable overriding INDEX_FIELDS, e.g. "date,author"
+#define INDEX_FIELDS_ENV    "COMPANY_INDEX_FIELDS"
 
 // Transfer time (1 AM)
 #define TRANSFER_TIME_HOUR 1
 #define TRANSFER_TIME_MIN  0
 
-// Message structure
-struct msg_buffer {
-    long msg_type;
-    char msg_text[100];
+// State handed from a daemon to its replacement on restart
+#define STATE_MAGIC     0x43535446u   // "CSTF"
+#define STATE_VERSION   1
+
+struct daemon_state {
+    uint32_t magic;
+    uint32_t version;
+    int64_t saved_at;
+    int64_t monitor_last_check;
+    int32_t last_transfer_date;      // YYYYMMDD of the last scheduled run
+    int32_t manual_transfer_pending;
 };
 
+// Start of a report, captured while it is copied
+struct report_header {
+    char data[INDEX_HEADER_BYTES];
+    size_t len;
+};
+
+// Index entry for a report, built while the report is copied and written
+// once it has been published
+struct report_entry {
+    char day[16];
+    char *line;
+    size_t len;
+};
+
+// Receives log messages instead of syslog and ERROR_LOG, see log_redirect()
+typedef void (*log_sink_fn)(int priority, const char *message);
+
+// Time of the last upload scan, carried across restarts
+extern time_t monitor_last_check;
+
 // Function declarations for company operations
 int lock_directories(void);
 int unlock_directories(void);
 int backup_reporting_dir(void);
 int transfer_uploads(void);
 int check_missing_uploads(void);
+struct storage_dir *reporting_open_snapshot(char *path, size_t size);
 void monitor_uploads(void);
 void log_message(int priority, const char *format, ...);
-int setup_ipc(void);
-int send_message(int msgid, long type, const char *msg);
-void cleanup_ipc(int msgid);
+void log_redirect(log_sink_fn sink);
+void report_header_collect(const char *data, size_t len, void *ctx);
+int report_index_prepare(struct report_entry *entry, const char *name, const char *department,
+                         const struct storage_stat *st, const struct report_header *header);
+int report_index_write(const struct report_entry *entry);
+void report_index_free(struct report_entry *entry);
+int setup_ipc(int reuse);
+void publish_event(int type, const char *format, ...);
+void detach_ipc(void);
+void cleanup_ipc(void);
 
 #endif /* COMPANY_H */
\ No newline at end of file
@@ -20,5 +20,12 @@ void signal_handler(int sig);
 int check_singleton(const char *lockfile);
 void write_pid_file(const char *pidfile);
 void cleanup(void);
+void notify_init(void);
+void notify_status(const char *format, ...);
+void notify_ready(void);
+void create_directories(void);
+int save_state(const char *statefile);
+int load_state(const char *statefile);
+void run_transfer(const char *name, int check_missing);
 
 #endif /* DAEMON_H */
\ No newline at end of file
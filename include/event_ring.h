@@ -0,0 +1,56 @@
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Shared memory object holding the daemon's event ring
+#define EVENT_RING_NAME     "/company_daemon_events"
+#define EVENT_RING_MAGIC    0x43455652u   // "CEVR"
+#define EVENT_RING_VERSION  1
+#define EVENT_RING_SLOTS    1024          // Must be a power of two
+#define EVENT_TEXT_SIZE     232
+
+// Event types
+#define EVENT_INFO      1
+#define EVENT_BACKUP    2
+#define EVENT_TRANSFER  3
+#define EVENT_CHANGE    4
+#define EVENT_ERROR     5
+
+// One ring slot. seq holds (sequence number + 1) once the slot is
+// committed and 0 while the producer is rewriting it, so a reader can
+// tell a stable slot from a torn or overwritten one.
+struct event_slot {
+    _Atomic uint64_t seq;
+    int64_t timestamp;
+    int32_t type;
+    int32_t pid;
+    char text[EVENT_TEXT_SIZE];
+};
+
+// Ring header followed by the slots. head is the sequence number the
+// producer will write next; readers never write to the segment.
+struct event_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    _Atomic uint64_t head;
+    struct event_slot slot[EVENT_RING_SLOTS];
+};
+
+// Return a printable name for an event type
+static inline const char *event_type_name(int type) {
+    switch (type) {
+        case EVENT_INFO:     return "info";
+        case EVENT_BACKUP:   return "backup";
+        case EVENT_TRANSFER: return "transfer";
+        case EVENT_CHANGE:   return "change";
+        case EVENT_ERROR:    return "error";
+        default:             return "unknown";
+    }
+}
+
+#endif /* EVENT_RING_H */
@@ -0,0 +1,126 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// Entry types reported while listing a directory
+#define STORAGE_UNKNOWN 0   // Backend could not tell, use stat_at()
+#define STORAGE_FILE    1
+#define STORAGE_DIR     2
+#define STORAGE_OTHER   3
+
+// Metadata a caller needs from stat_at(); the file type is always filled
+#define STORAGE_STAT_MODE   0x01
+#define STORAGE_STAT_OWNER  0x02
+#define STORAGE_STAT_SIZE   0x04
+#define STORAGE_STAT_TIMES  0x08
+#define STORAGE_STAT_ALL    0x0f
+
+// Directory entry
+struct storage_entry {
+    char name[256];
+    int type;
+};
+
+// File metadata
+struct storage_stat {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t atime;
+    time_t mtime;
+};
+
+// Open directory, defined by each backend
+struct storage_dir;
+
+// Storage backend operations. Every operation returns -1 (or NULL) and
+// sets errno on failure, like the POSIX calls they stand in for. Files
+// are named relative to an open directory so a backend can resolve the
+// directory once and reuse it for every entry.
+struct storage_ops {
+    const char *name;
+    
+    // Directories
+    struct storage_dir *(*dir_open)(const char *path);
+    int (*dir_next)(struct storage_dir *dir, struct storage_entry *entry);  // 1 entry, 0 end, -1 error
+    void (*dir_close)(struct storage_dir *dir);
+    int (*mkdir)(const char *path, mode_t mode);
+    int (*rmdir)(const char *path);
+    int (*chmod)(const char *path, mode_t mode);
+    int (*exists)(const char *path);
+    int (*dir_trylock)(struct storage_dir *dir, int exclusive);  // Non-blocking, released on dir_close
+    
+    // Entries within an open directory
+    int (*stat_at)(struct storage_dir *dir, const char *name, struct storage_stat *st, int want);
+    int (*open_at)(struct storage_dir *dir, const char *name, int flags, mode_t mode);
+    int (*chown_at)(struct storage_dir *dir, const char *name, uid_t uid, gid_t gid);
+    int (*chmod_at)(struct storage_dir *dir, const char *name, mode_t mode);
+    int (*utime_at)(struct storage_dir *dir, const char *name, time_t atime, time_t mtime);
+    int (*unlink_at)(struct storage_dir *dir, const char *name);
+    int (*link_at)(struct storage_dir *src_dir, const char *src_name,
+                   struct storage_dir *dst_dir, const char *dst_name);
+    int (*rename_at)(struct storage_dir *src_dir, const char *src_name,
+                     struct storage_dir *dst_dir, const char *dst_name);
+    int (*symlink_at)(const char *target, struct storage_dir *dir, const char *name);
+    ssize_t (*readlink_at)(struct storage_dir *dir, const char *name, char *buf, size_t size);
+    
+    // Optional native copy, e.g. a reference copy in a content-addressed
+    // store. When NULL, or when the caller wants to see the data,
+    // storage_copy() streams through read/write.
+    int (*copy_at)(struct storage_dir *src_dir, const char *src_name,
+                   struct storage_dir *dst_dir, const char *dst_name);
+    
+    // Handles returned by open_at()
+    ssize_t (*read)(int fd, void *buf, size_t len);
+    ssize_t (*write)(int fd, const void *buf, size_t len);
+    int (*close)(int fd);
+};
+
+// Available backends
+extern const struct storage_ops posix_storage;
+extern const struct storage_ops memory_storage;
+
+// Called by storage_copy() with each chunk of data as it is copied
+typedef void (*storage_copy_fn)(const char *data, size_t len, void *ctx);
+
+// Called by storage_scan() for each regular file
+typedef void (*storage_scan_fn)(struct storage_dir *dir, const struct storage_entry *entry, void *ctx);
+
+// Backend used by the file operations
+extern const struct storage_ops *storage;
+
+// Function declarations for the storage layer
+const struct storage_ops *storage_find(const char *name);
+void storage_use(const struct storage_ops *ops);
+int storage_copy(struct storage_dir *src_dir, const char *src_name,
+                 struct storage_dir *dst_dir, const char *dst_name,
+                 storage_copy_fn observe, void *ctx);
+int storage_scan(const char *path, storage_scan_fn fn, void *ctx);
+
+// Operations the in-memory backend can be told to fail
+#define MEMORY_FAULT_OPEN    0
+#define MEMORY_FAULT_READ    1
+#define MEMORY_FAULT_WRITE   2
+#define MEMORY_FAULT_CLOSE   3
+#define MEMORY_FAULT_STAT    4
+#define MEMORY_FAULT_CHOWN   5
+#define MEMORY_FAULT_UTIME   6
+#define MEMORY_FAULT_UNLINK  7
+#define MEMORY_FAULT_MKDIR   8
+#define MEMORY_FAULT_CHMOD   9
+#define MEMORY_FAULT_DIR     10
+#define MEMORY_FAULT_LINK    11
+#define MEMORY_FAULT_RENAME  12
+#define MEMORY_FAULT_COUNT   13
+
+// In-memory backend control, for benchmarks and fault injection
+void memory_storage_reset(void);
+int memory_storage_put(const char *path, const void *data, size_t len,
+                       uid_t uid, gid_t gid, time_t mtime);
+void memory_storage_fail(int op, int err, unsigned after, unsigned times);
+void memory_storage_short_writes(size_t max);
+
+#endif /* STORAGE_H */
@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Tracing is on while this file exists (see "company_control trace")
+#define TRACE_FLAG          "/var/run/company_daemon.trace"
+#define TRACE_DIR           "/var/company/logs/traces"
+
+// The upload monitor runs every few minutes, so it is only traced when
+// the flag file names it ("company_control trace on monitor")
+#define TRACE_MONITOR       "monitor"
+
+// Oldest trace files are removed beyond this many
+#define TRACE_KEEP_FILES    50
+
+// Per-thread limits
+#define TRACE_MAX_EVENTS    65536
+#define TRACE_MAX_DEPTH     32
+#define TRACE_ARG_SIZE      64
+
+// Completed span, written out as a Chrome trace "X" event
+struct trace_event {
+    const char *cat;
+    const char *name;
+    uint64_t start_us;
+    uint64_t dur_us;
+    char arg[TRACE_ARG_SIZE];
+};
+
+// Span that has begun but not yet ended
+struct trace_open_span {
+    const char *cat;
+    const char *name;
+    uint64_t start_us;
+    char arg[TRACE_ARG_SIZE];
+};
+
+// Events recorded by one thread. Threads only ever append to their own
+// buffer, so recording a span takes no lock.
+struct trace_buffer {
+    struct trace_buffer *next;
+    int tid;
+    unsigned count;
+    unsigned dropped;
+    unsigned depth;
+    struct trace_open_span stack[TRACE_MAX_DEPTH];
+    struct trace_event events[TRACE_MAX_EVENTS];
+};
+
+// Nonzero while a traced session is running
+extern int trace_active;
+
+// Function declarations for tracing
+int trace_session_begin(const char *name);
+void trace_session_end(void);
+void trace_begin(const char *cat, const char *name, const char *arg);
+void trace_end(void);
+
+#endif /* TRACE_H */
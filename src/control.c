@@ -5,11 +5,30 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../include/event_ring.h"
 
+#define DAEMON_PATH "/usr/sbin/company_daemon"
 #define PID_FILE "/var/run/company_daemon.pid"
+#define LOCK_FILE "/var/run/company_daemon.lock"
+#define NOTIFY_FD_ENV "COMPANY_NOTIFY_FD"
+#define TRACE_FLAG "/var/run/company_daemon.trace"
+#define TRACE_DIR "/var/company/logs/traces"
+#define TRACE_MONITOR "monitor"
+#define INDEX_DIR "/var/company/index"
+
+// How long to wait for the daemon to report readiness or to exit
+#define START_TIMEOUT_MS 10000
+#define STOP_TIMEOUT_SEC 120
 
 void usage(void) {
-    printf("Usage: company_control {start|stop|status|backup}\n");
+    printf("Usage: company_control {start|stop|restart|status|backup|watch|trace {on [monitor]|off|status}|index YYYYMMDD [key=value]}\n");
     exit(EXIT_FAILURE);
 }
 
@@ -31,23 +50,85 @@ void start_daemon(void) {
     
     // Start daemon
     printf("Starting daemon...\n");
-    system("/usr/sbin/company_daemon");
-    sleep(1);
     
-    // Check if daemon started
-    pid_file = fopen(PID_FILE, "r");
-    if (pid_file) {
-        pid_t pid;
-        if (fscanf(pid_file, "%d", &pid) == 1) {
-            printf("Daemon started with PID %d\n", pid);
-        } else {
-            printf("Daemon started, but could not read PID\n");
+    int fds[2];
+    if (pipe(fds) < 0) {
+        printf("Failed to create readiness pipe: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    
+    pid_t child = fork();
+    if (child < 0) {
+        printf("Failed to fork: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    
+    if (child == 0) {
+        char fd_str[16];
+        snprintf(fd_str, sizeof(fd_str), "%d", fds[1]);
+        setenv(NOTIFY_FD_ENV, fd_str, 1);
+        execl(DAEMON_PATH, DAEMON_PATH, (char *)NULL);
+        _exit(127);
+    }
+    
+    close(fds[1]);
+    
+    // Collect notification lines until the daemon closes the pipe
+    char notice[512];
+    size_t len = 0;
+    int timed_out = 0;
+    while (len < sizeof(notice) - 1) {
+        struct pollfd pfd = {fds[0], POLLIN, 0};
+        int ready = poll(&pfd, 1, START_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) {
+            continue;
         }
-        fclose(pid_file);
+        if (ready <= 0) {
+            timed_out = (ready == 0);
+            break;
+        }
+        
+        ssize_t n = read(fds[0], notice + len, sizeof(notice) - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        
+        notice[len] = '\0';
+        if (strstr(notice, "READY=1\n")) {
+            break;
+        }
+    }
+    notice[len] = '\0';
+    close(fds[0]);
+    
+    // Reap the launcher; it exits as soon as the daemon has forked
+    int status;
+    waitpid(child, &status, 0);
+    
+    char *mainpid = strstr(notice, "MAINPID=");
+    if (strstr(notice, "READY=1\n") && mainpid) {
+        printf("Daemon started with PID %d\n", atoi(mainpid + strlen("MAINPID=")));
+        return;
+    }
+    
+    char *reason = strstr(notice, "STATUS=");
+    if (reason) {
+        reason += strlen("STATUS=");
+        reason[strcspn(reason, "\n")] = '\0';
+        printf("Failed to start daemon: %s\n", reason);
+    } else if (timed_out) {
+        printf("Failed to start daemon: no readiness notification after %d ms\n", START_TIMEOUT_MS);
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        printf("Failed to start daemon: could not execute %s\n", DAEMON_PATH);
     } else {
         printf("Failed to start daemon\n");
-        exit(EXIT_FAILURE);
     }
+    exit(EXIT_FAILURE);
 }
 
 // Stop the daemon
@@ -76,6 +157,64 @@ void stop_daemon(void) {
     printf("Daemon stopped\n");
 }
 
+static void alarm_handler(int sig) {
+    (void)sig;
+}
+
+// Restart the daemon, handing its state over to the new instance
+void restart_daemon(void) {
+    FILE *pid_file = fopen(PID_FILE, "r");
+    pid_t pid = 0;
+    if (pid_file) {
+        if (fscanf(pid_file, "%d", &pid) != 1) {
+            pid = 0;
+        }
+        fclose(pid_file);
+    }
+    
+    if (pid > 0 && kill(pid, 0) == 0) {
+        printf("Handing over from daemon with PID %d...\n", pid);
+        if (kill(pid, SIGUSR2) < 0) {
+            printf("Failed to signal daemon: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        
+        // The daemon holds the lock file until it exits, so waiting for
+        // the lock tells us exactly when the old instance is gone. The
+        // handover has already begun, so a slow exit (e.g. in the middle
+        // of a transfer) is waited out rather than abandoned.
+        int fd = open(LOCK_FILE, O_RDONLY);
+        if (fd >= 0) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = alarm_handler;
+            sigaction(SIGALRM, &sa, NULL);
+            
+            int waited = 0;
+            while (1) {
+                alarm(STOP_TIMEOUT_SEC);
+                int locked = flock(fd, LOCK_EX);
+                alarm(0);
+                
+                if (locked == 0) {
+                    break;
+                }
+                if (errno != EINTR) {
+                    printf("Failed to wait for daemon with PID %d: %s\n", pid, strerror(errno));
+                    close(fd);
+                    exit(EXIT_FAILURE);
+                }
+                
+                waited += STOP_TIMEOUT_SEC;
+                printf("Daemon with PID %d is still shutting down after %d seconds, waiting...\n", pid, waited);
+            }
+            close(fd);
+        }
+    }
+    
+    start_daemon();
+}
+
 // Check daemon status
 void check_status(void) {
     FILE *pid_file = fopen(PID_FILE, "r");
@@ -127,7 +266,340 @@ void backup(void) {
     printf("Backup/transfer triggered\n");
 }
 
+// Print one event
+static void print_event(const struct event_slot *event) {
+    time_t when = (time_t)event->timestamp;
+    struct tm *tm_info = localtime(&when);
+    char timestamp[64];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+    
+    printf("[%s] %-8s %s\n", timestamp, event_type_name(event->type), event->text);
+}
+
+// Map the daemon's event ring. The descriptor is kept open so the
+// watcher can tell when the ring has been removed.
+static const struct event_ring *open_ring(int *fd_out) {
+    int fd = shm_open(EVENT_RING_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    const struct event_ring *ring = mmap(NULL, sizeof(struct event_ring), PROT_READ, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    
+    if (ring->magic != EVENT_RING_MAGIC ||
+        ring->version != EVENT_RING_VERSION ||
+        ring->slots != EVENT_RING_SLOTS ||
+        ring->slot_size != sizeof(struct event_slot)) {
+        munmap((void *)ring, sizeof(struct event_ring));
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    
+    *fd_out = fd;
+    return ring;
+}
+
+// Nonzero once the ring has been unlinked, e.g. by a daemon that stopped
+static int ring_removed(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_nlink == 0;
+}
+
+// Tail the daemon's event ring. Events are read straight from shared
+// memory, so only the idle wait between bursts costs a system call.
+void watch_events(void) {
+    int fd;
+    const struct event_ring *ring = open_ring(&fd);
+    if (!ring) {
+        if (errno == EPROTO) {
+            printf("Event ring has an incompatible layout\n");
+        } else {
+            printf("Event ring not available: %s\n", strerror(errno));
+        }
+        exit(EXIT_FAILURE);
+    }
+    
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    
+    uint64_t next = atomic_load_explicit(&ring->head, memory_order_acquire);
+    const struct timespec idle = {0, 100 * 1000 * 1000};
+    const struct timespec retry = {1, 0};
+    
+    while (1) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (next == head) {
+            if (!ring_removed(fd)) {
+                nanosleep(&idle, NULL);
+                continue;
+            }
+            
+            // The daemon stopped and removed the ring. Wait for the next
+            // instance to create a new one and follow it from the start.
+            printf("*** daemon stopped, waiting for it to start again ***\n");
+            munmap((void *)ring, sizeof(struct event_ring));
+            close(fd);
+            
+            while (!(ring = open_ring(&fd))) {
+                nanosleep(&retry, NULL);
+            }
+            
+            printf("*** daemon started, watching new event ring ***\n");
+            next = 0;
+            continue;
+        }
+        
+        // Skip ahead if the producer has lapped us
+        if (head - next > EVENT_RING_SLOTS) {
+            uint64_t oldest = head - EVENT_RING_SLOTS;
+            printf("*** fell behind, %llu events lost ***\n", (unsigned long long)(oldest - next));
+            next = oldest;
+        }
+        
+        const struct event_slot *slot = &ring->slot[next & (EVENT_RING_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        
+        struct event_slot event;
+        event.timestamp = slot->timestamp;
+        event.type = slot->type;
+        event.pid = slot->pid;
+        memcpy(event.text, slot->text, sizeof(event.text));
+        event.text[sizeof(event.text) - 1] = '\0';
+        
+        // The copy is only valid if the slot was not rewritten meanwhile
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != next + 1 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            printf("*** fell behind, 1 event lost ***\n");
+            next++;
+            continue;
+        }
+        
+        print_event(&event);
+        next++;
+    }
+}
+
+// Switch tracing of daemon runs on or off. The daemon checks the flag
+// file at the start of every run, so no restart is needed. The upload
+// monitor is only traced when asked for, as it runs every few minutes.
+void trace_control(const char *mode, const char *extra) {
+    if (extra && (strcmp(mode, "on") != 0 || strcmp(extra, TRACE_MONITOR) != 0)) {
+        usage();
+    }
+    
+    if (strcmp(mode, "on") == 0) {
+        int fd = open(TRACE_FLAG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            printf("Failed to enable tracing: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (extra && write(fd, TRACE_MONITOR "\n", strlen(TRACE_MONITOR) + 1) < 0) {
+            printf("Failed to enable monitor tracing: %s\n", strerror(errno));
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        printf("Tracing enabled%s, traces will be written to %s\n",
+               extra ? " including the upload monitor" : "", TRACE_DIR);
+    } else if (strcmp(mode, "off") == 0) {
+        if (unlink(TRACE_FLAG) < 0 && errno != ENOENT) {
+            printf("Failed to disable tracing: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        printf("Tracing disabled\n");
+    } else if (strcmp(mode, "status") == 0) {
+        char flag[64] = "";
+        FILE *f = fopen(TRACE_FLAG, "r");
+        if (!f) {
+            printf("Tracing is disabled\n");
+            return;
+        }
+        if (!fgets(flag, sizeof(flag), f)) {
+            flag[0] = '\0';
+        }
+        fclose(f);
+        printf("Tracing is enabled%s\n", strstr(flag, TRACE_MONITOR) ? " including the upload monitor" : "");
+    } else {
+        usage();
+    }
+}
+
+// Copy the value of "file" from an index line
+static void index_file_name(const char *line, char *name, size_t size) {
+    name[0] = '\0';
+    const char *start = strstr(line, "\"file\":\"");
+    if (!start) {
+        return;
+    }
+    
+    start += strlen("\"file\":\"");
+    size_t len = 0;
+    while (start[len] && !(start[len] == '"' && (len == 0 || start[len - 1] != '\\'))) {
+        len++;
+    }
+    
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    memcpy(name, start, len);
+    name[len] = '\0';
+}
+
+// Append s to out as the inside of a JSON string literal, the way the
+// daemon writes index values
+static void json_escape(const char *s, size_t n, char *out, size_t size) {
+    size_t len = 0;
+    for (size_t i = 0; i < n && s[i]; i++) {
+        unsigned char c = s[i];
+        char escaped[8];
+        if (c == '"' || c == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        } else {
+            snprintf(escaped, sizeof(escaped), "%c", c);
+        }
+        
+        size_t escaped_len = strlen(escaped);
+        if (len + escaped_len >= size) {
+            break;
+        }
+        memcpy(out + len, escaped, escaped_len);
+        len += escaped_len;
+    }
+    out[len] = '\0';
+}
+
+// One line of a day's index
+struct index_entry {
+    char *line;
+    char name[256];
+    size_t pos;
+    int latest;
+};
+
+// Order entries by report name, then by position in the index
+static int compare_entries(const void *a, const void *b) {
+    const struct index_entry *ea = *(struct index_entry *const *)a;
+    const struct index_entry *eb = *(struct index_entry *const *)b;
+    int result = strcmp(ea->name, eb->name);
+    if (result != 0) {
+        return result;
+    }
+    return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+// Print the reports indexed for a day, optionally only those with a
+// matching key, e.g. department=sales or author=smith. When a report was
+// transferred more than once only its latest entry is shown.
+void query_index(const char *day, const char *filter) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.jsonl", INDEX_DIR, day);
+    
+    FILE *index = fopen(path, "r");
+    if (!index) {
+        printf("No index for %s: %s\n", day, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    
+    // Turn key=value into the JSON text it must match
+    char match[1024] = "";
+    if (filter) {
+        const char *eq = strchr(filter, '=');
+        if (!eq) {
+            fclose(index);
+            usage();
+        }
+        
+        char key[256];
+        char value[512];
+        json_escape(filter, eq - filter, key, sizeof(key));
+        json_escape(eq + 1, strlen(eq + 1), value, sizeof(value));
+        snprintf(match, sizeof(match), "\"%s\":\"%s\"", key, value);
+    }
+    
+    // Read every entry, parsing its report name once
+    struct index_entry *entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, index) > 0) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct index_entry *grown = realloc(entries, cap * sizeof(struct index_entry));
+            if (!grown) {
+                printf("Out of memory reading %s\n", path);
+                exit(EXIT_FAILURE);
+            }
+            entries = grown;
+        }
+        
+        struct index_entry *entry = &entries[count];
+        entry->line = line;
+        entry->pos = count;
+        entry->latest = 0;
+        index_file_name(line, entry->name, sizeof(entry->name));
+        count++;
+        
+        line = NULL;
+        line_size = 0;
+    }
+    free(line);
+    fclose(index);
+    
+    // Group the entries by report; the last of each group is the latest
+    struct index_entry **sorted = malloc((count ? count : 1) * sizeof(struct index_entry *));
+    if (!sorted) {
+        printf("Out of memory reading %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = &entries[i];
+    }
+    qsort(sorted, count, sizeof(struct index_entry *), compare_entries);
+    
+    for (size_t i = 0; i < count; i++) {
+        if (i + 1 == count || strcmp(sorted[i]->name, sorted[i + 1]->name) != 0) {
+            sorted[i]->latest = 1;
+        }
+    }
+    free(sorted);
+    
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].latest && (!filter || strstr(entries[i].line, match))) {
+            fputs(entries[i].line, stdout);
+        }
+        free(entries[i].line);
+    }
+    free(entries);
+}
+
 int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+    }
+    
+    if (strcmp(argv[1], "trace") == 0) {
+        if (argc != 3 && argc != 4) {
+            usage();
+        }
+        trace_control(argv[2], argc == 4 ? argv[3] : NULL);
+        return EXIT_SUCCESS;
+    }
+    
+    if (strcmp(argv[1], "index") == 0) {
+        if (argc != 3 && argc != 4) {
+            usage();
+        }
+        query_index(argv[2], argc == 4 ? argv[3] : NULL);
+        return EXIT_SUCCESS;
+    }
+    
     if (argc != 2) {
         usage();
     }
@@ -136,10 +608,14 @@ int main(int argc, char *argv[]) {
         start_daemon();
     } else if (strcmp(argv[1], "stop") == 0) {
         stop_daemon();
+    } else if (strcmp(argv[1], "restart") == 0) {
+        restart_daemon();
     } else if (strcmp(argv[1], "status") == 0) {
         check_status();
     } else if (strcmp(argv[1], "backup") == 0) {
         backup();
+    } else if (strcmp(argv[1], "watch") == 0) {
+        watch_events();
     } else {
         usage();
     }
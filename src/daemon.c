@@ -1,10 +1,18 @@
 #include "../include/daemon.h"
 #include "../include/company.h"
+#include <stdarg.h>
+#include <sys/file.h>
+#include <sys/select.h>
 
 // Global variables
 int running = 1;
 int transfer_in_progress = 0;
-int msgid;
+volatile sig_atomic_t manual_transfer_requested = 0;
+volatile sig_atomic_t handover_requested = 0;
+int last_transfer_date = 0;
+
+// Write end of the readiness pipe handed to us by company_control
+static int notify_fd = -1;
 
 // Function to daemonize the process
 void daemonize(void) {
@@ -42,14 +50,13 @@ void signal_handler(int sig) {
             running = 0;
             break;
         case SIGUSR1:
-            if (!transfer_in_progress) {
-                log_message(LOG_INFO, "Received SIGUSR1 signal, starting manual backup/transfer");
-                if (lock_directories() == 0) {
-                    backup_reporting_dir();
-                    transfer_uploads();
-                    unlock_directories();
-                }
-            }
+            // Run from the main loop so the daemon stays the only event producer
+            manual_transfer_requested = 1;
+            break;
+        case SIGUSR2:
+            // Shut down, leaving state behind for the next instance
+            handover_requested = 1;
+            running = 0;
             break;
     }
 }
@@ -58,23 +65,19 @@ void signal_handler(int sig) {
 void setup_signals(void) {
     signal(SIGTERM, signal_handler);
     signal(SIGUSR1, signal_handler);
+    signal(SIGUSR2, signal_handler);
     signal(SIGHUP, SIG_IGN);  // Ignore SIGHUP
 }
 
-// Check for singleton instance
+// Check for singleton instance. The lock is taken with flock() so it
+// survives the fork in daemonize() and is held until the daemon exits.
 int check_singleton(const char *lockfile) {
-    int fd = open(lockfile, O_RDWR | O_CREAT, 0640);
+    int fd = open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
     if (fd < 0) {
         return 0;
     }
     
-    struct flock fl;
-    fl.l_type = F_WRLCK;
-    fl.l_start = 0;
-    fl.l_whence = SEEK_SET;
-    fl.l_len = 0;
-    
-    if (fcntl(fd, F_SETLK, &fl) < 0) {
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
         close(fd);
         return 0;
     }
@@ -91,20 +94,203 @@ void write_pid_file(const char *pidfile) {
     }
 }
 
+// Pick up the readiness pipe passed in the environment, if any
+void notify_init(void) {
+    const char *value = getenv(NOTIFY_FD_ENV);
+    if (!value) {
+        return;
+    }
+    
+    notify_fd = atoi(value);
+    if (notify_fd <= STDERR_FILENO || fcntl(notify_fd, F_SETFD, FD_CLOEXEC) < 0) {
+        notify_fd = -1;
+    }
+    
+    unsetenv(NOTIFY_FD_ENV);
+}
+
+// Send a status line to whoever is waiting for us to start
+void notify_status(const char *format, ...) {
+    if (notify_fd < 0) {
+        return;
+    }
+    
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = snprintf(line, sizeof(line), "STATUS=");
+    len += vsnprintf(line + len, sizeof(line) - len - 1, format, args);
+    va_end(args);
+    
+    if (len > (int)sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+    
+    if (write(notify_fd, line, len) < 0) {
+        log_message(LOG_ERR, "Failed to write readiness status: %s", strerror(errno));
+    }
+}
+
+// Tell the waiting control program that startup has finished
+void notify_ready(void) {
+    if (notify_fd < 0) {
+        return;
+    }
+    
+    char line[64];
+    int len = snprintf(line, sizeof(line), "READY=1\nMAINPID=%d\n", getpid());
+    if (write(notify_fd, line, len) < 0) {
+        log_message(LOG_ERR, "Failed to write readiness notification: %s", strerror(errno));
+    }
+    
+    close(notify_fd);
+    notify_fd = -1;
+}
+
+// Create the directory tree, tolerating directories that already exist
+void create_directories(void) {
+    const char *dirs[] = {
+        UPLOAD_DIR, REPORTING_DIR, BACKUP_DIR, LOG_DIR,
+        UPLOAD_DIR "/warehouse", UPLOAD_DIR "/manufacturing",
+        UPLOAD_DIR "/sales", UPLOAD_DIR "/distribution",
+        NULL
+    };
+    
+    for (int i = 0; dirs[i] != NULL; i++) {
+        if (storage->mkdir(dirs[i], 0755) < 0 && errno != EEXIST) {
+            log_message(LOG_ERR, "Failed to create directory %s: %s", dirs[i], strerror(errno));
+        }
+    }
+}
+
+// Save in-flight state for the instance that replaces us
+int save_state(const char *statefile) {
+    struct daemon_state state;
+    memset(&state, 0, sizeof(state));
+    state.magic = STATE_MAGIC;
+    state.version = STATE_VERSION;
+    state.saved_at = time(NULL);
+    state.monitor_last_check = monitor_last_check;
+    state.last_transfer_date = last_transfer_date;
+    state.manual_transfer_pending = manual_transfer_requested;
+    
+    // Write to a temporary file and rename so a reader never sees half a state
+    char tmpfile[256];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", statefile);
+    
+    int fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        log_message(LOG_ERR, "Failed to create state file %s: %s", tmpfile, strerror(errno));
+        return -1;
+    }
+    
+    if (write(fd, &state, sizeof(state)) != (ssize_t)sizeof(state)) {
+        log_message(LOG_ERR, "Failed to write state file %s: %s", tmpfile, strerror(errno));
+        close(fd);
+        unlink(tmpfile);
+        return -1;
+    }
+    
+    close(fd);
+    
+    if (rename(tmpfile, statefile) < 0) {
+        log_message(LOG_ERR, "Failed to install state file %s: %s", statefile, strerror(errno));
+        unlink(tmpfile);
+        return -1;
+    }
+    
+    log_message(LOG_INFO, "Saved daemon state to %s", statefile);
+    return 0;
+}
+
+// Restore state left by a previous instance. The file is consumed so a
+// stale handover is never applied twice.
+int load_state(const char *statefile) {
+    int fd = open(statefile, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct daemon_state state;
+    ssize_t bytes_read = read(fd, &state, sizeof(state));
+    close(fd);
+    unlink(statefile);
+    
+    if (bytes_read != (ssize_t)sizeof(state) ||
+        state.magic != STATE_MAGIC ||
+        state.version != STATE_VERSION) {
+        log_message(LOG_ERR, "Ignoring incompatible state file %s", statefile);
+        return -1;
+    }
+    
+    monitor_last_check = state.monitor_last_check;
+    last_transfer_date = state.last_transfer_date;
+    if (state.manual_transfer_pending) {
+        manual_transfer_requested = 1;
+    }
+    
+    log_message(LOG_INFO, "Restored daemon state saved at %lld", (long long)state.saved_at);
+    return 0;
+}
+
 // Clean up before exit
 void cleanup(void) {
     if (transfer_in_progress) {
         unlock_directories();
     }
     
-    cleanup_ipc(msgid);
+    if (handover_requested) {
+        // Keep the event ring so subscribers carry on across the restart
+        save_state(STATE_FILE);
+        detach_ipc();
+    } else {
+        cleanup_ipc();
+    }
+    
     unlink(PID_FILE);
 }
 
+// Run one backup and transfer, traced when tracing is switched on
+void run_transfer(const char *name, int check_missing) {
+    transfer_in_progress = 1;
+    trace_session_begin(name);
+    
+    trace_begin("phase", "lock", NULL);
+    int locked = lock_directories();
+    trace_end();
+    
+    if (locked == 0) {
+        trace_begin("phase", "backup", NULL);
+        backup_reporting_dir();
+        trace_end();
+        
+        trace_begin("phase", "transfer", NULL);
+        transfer_uploads();
+        trace_end();
+        
+        if (check_missing) {
+            trace_begin("phase", "missing check", NULL);
+            check_missing_uploads();
+            trace_end();
+        }
+        
+        trace_begin("phase", "unlock", NULL);
+        unlock_directories();
+        trace_end();
+    }
+    
+    trace_session_end();
+    transfer_in_progress = 0;
+}
+
 int main(void) {
+    notify_init();
+    
     // Check if another instance is running
     if (!check_singleton(LOCK_FILE)) {
         fprintf(stderr, "Another instance is already running\n");
+        notify_status("Another instance is already running");
         exit(EXIT_FAILURE);
     }
     
@@ -117,61 +303,80 @@ int main(void) {
     // Write PID to file
     write_pid_file(PID_FILE);
     
+    // Select the storage backend
+    const char *backend = getenv(STORAGE_ENV);
+    if (backend) {
+        const struct storage_ops *ops = storage_find(backend);
+        if (ops) {
+            storage_use(ops);
+        } else {
+            log_message(LOG_ERR, "Unknown storage backend %s, using %s", backend, storage->name);
+        }
+    }
+    
     // Create directories if they don't exist
-    mkdir(UPLOAD_DIR, 0755);
-    mkdir(REPORTING_DIR, 0755);
-    mkdir(BACKUP_DIR, 0755);
-    mkdir(LOG_DIR, 0755);
-    
-    // Create department directories
-    char path[256];
-    sprintf(path, "%s/warehouse", UPLOAD_DIR);
-    mkdir(path, 0755);
-    sprintf(path, "%s/manufacturing", UPLOAD_DIR);
-    mkdir(path, 0755);
-    sprintf(path, "%s/sales", UPLOAD_DIR);
-    mkdir(path, 0755);
-    sprintf(path, "%s/distribution", UPLOAD_DIR);
-    mkdir(path, 0755);
+    create_directories();
+    
+    // Pick up where a previous instance left off
+    int handed_over = load_state(STATE_FILE) == 0;
+    
+    // Control signals stay blocked except while the main loop waits, so
+    // one that arrives between checking the flags and going to sleep
+    // ends the wait instead of being noticed a minute later
+    sigset_t control_signals, wait_mask;
+    sigemptyset(&control_signals);
+    sigaddset(&control_signals, SIGTERM);
+    sigaddset(&control_signals, SIGUSR1);
+    sigaddset(&control_signals, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &control_signals, &wait_mask);
     
     // Set up signal handlers
     setup_signals();
     
     // Set up IPC
-    msgid = setup_ipc();
+    setup_ipc(handed_over);
     
     log_message(LOG_INFO, "Daemon started");
+    publish_event(EVENT_INFO, "Daemon started with PID %d", getpid());
+    notify_ready();
     
     // Main loop
     while (running) {
         // Get current time
         time_t now = time(NULL);
         struct tm *tm_info = localtime(&now);
+        int today = (tm_info->tm_year + 1900) * 10000 + (tm_info->tm_mon + 1) * 100 + tm_info->tm_mday;
         
         // Check if it's time for scheduled backup/transfer (1 AM)
         if (tm_info->tm_hour == TRANSFER_TIME_HOUR && 
             tm_info->tm_min == TRANSFER_TIME_MIN && 
+            today != last_transfer_date &&
             !transfer_in_progress) {
             
             log_message(LOG_INFO, "Starting scheduled backup and transfer");
-            
-            transfer_in_progress = 1;
-            
-            if (lock_directories() == 0) {
-                backup_reporting_dir();
-                transfer_uploads();
-                check_missing_uploads();
-                unlock_directories();
-            }
-            
-            transfer_in_progress = 0;
+            run_transfer("scheduled", 1);
+            last_transfer_date = today;
+        }
+        
+        // Handle manual backup/transfer requested via SIGUSR1
+        if (manual_transfer_requested && !transfer_in_progress) {
+            manual_transfer_requested = 0;
+            log_message(LOG_INFO, "Received SIGUSR1 signal, starting manual backup/transfer");
+            run_transfer("manual", 0);
         }
         
         // Monitor upload directory for changes
         monitor_uploads();
         
-        // Sleep for a minute
-        sleep(60);
+        // Sleep for a minute, or until a signal arrives
+        if (running && !manual_transfer_requested) {
+            struct timespec minute = {60, 0};
+            pselect(0, NULL, NULL, NULL, &minute, &wait_mask);
+        }
+    }
+    
+    if (handover_requested) {
+        log_message(LOG_INFO, "Received SIGUSR2 signal, handing over to new instance");
     }
     
     // Cleanup before exit
@@ -179,4 +384,4 @@ int main(void) {
     closelog();
     
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
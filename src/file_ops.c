@@ -5,7 +5,18 @@
 #include <pwd.h>
 #include <stdarg.h>
 #include <time.h>
-#include <utime.h>
+
+// Time of the last upload scan
+time_t monitor_last_check = 0;
+
+// Where log messages go instead of syslog and ERROR_LOG, NULL for those
+static log_sink_fn log_sink = NULL;
+
+// Send log messages to sink rather than the daemon's logs, e.g. so that
+// checks run against the in-memory backend never reach the real logs
+void log_redirect(log_sink_fn sink) {
+    log_sink = sink;
+}
 
 // Log a message to both syslog and log file
 // Log a message to both syslog and log file
@@ -18,9 +29,21 @@ void log_message(int priority, const char *format, ...) {
     vsnprintf(message, sizeof(message), format, args);
     va_end(args);
     
+    if (log_sink) {
+        log_sink(priority, message);
+        return;
+    }
+    
+    trace_begin("log", "log message", NULL);
+    
     // Log to syslog
     syslog(priority, "%s", message);
     
+    // Let subscribers see errors as they happen
+    if (priority == LOG_ERR) {
+        publish_event(EVENT_ERROR, "%s", message);
+    }
+    
     // Make sure logs directory exists
     mkdir(LOG_DIR, 0755);
     
@@ -39,24 +62,21 @@ void log_message(int priority, const char *format, ...) {
             syslog(LOG_ERR, "Failed to open error log file: %s", strerror(errno));
         }
     }
+    
+    trace_end();
 }
 
 // Lock directories for backup/transfer
 int lock_directories(void) {
     log_message(LOG_INFO, "Locking directories");
     
-    // Change permissions to read-only
-    if (chmod(UPLOAD_DIR, 0555) < 0) {
+    // Change permissions to read-only. The reporting directory stays
+    // open: readers keep using the published generation throughout.
+    if (storage->chmod(UPLOAD_DIR, 0555) < 0) {
         log_message(LOG_ERR, "Failed to lock upload directory: %s", strerror(errno));
         return -1;
     }
     
-    if (chmod(REPORTING_DIR, 0555) < 0) {
-        log_message(LOG_ERR, "Failed to lock reporting directory: %s", strerror(errno));
-        chmod(UPLOAD_DIR, 0755);  // Reset upload directory
-        return -1;
-    }
-    
     return 0;
 }
 
@@ -65,172 +85,567 @@ int unlock_directories(void) {
     log_message(LOG_INFO, "Unlocking directories");
     
     // Reset permissions
-    if (chmod(UPLOAD_DIR, 0755) < 0) {
+    if (storage->chmod(UPLOAD_DIR, 0755) < 0) {
         log_message(LOG_ERR, "Failed to unlock upload directory: %s", strerror(errno));
         return -1;
     }
     
-    if (chmod(REPORTING_DIR, 0755) < 0) {
-        log_message(LOG_ERR, "Failed to unlock reporting directory: %s", strerror(errno));
-        return -1;
+    return 0;
+}
+
+// Upload copied into the new generation. The upload is only removed,
+// and its index entry only written, once that generation is published.
+struct transfer_record {
+    const char *department;
+    char name[256];
+    struct report_entry index;
+};
+
+// Uploads copied so far in this transfer
+struct transfer_list {
+    struct transfer_record *records;
+    size_t count;
+    size_t cap;
+};
+
+// Directories shared by the per-file scan callbacks
+struct scan_context {
+    struct storage_dir *dst_dir;
+    struct storage_dir *base_dir;
+    const char *src_path;
+    const char *dst_path;
+    const char *department;
+    struct transfer_list *pending;
+    int failed;   // Set when the new generation is missing a report
+};
+
+// Find the name of the published reporting generation
+static int current_generation(struct storage_dir *root, char *name, size_t size) {
+    return storage->readlink_at(root, REPORTING_CURRENT, name, size) < 0 ? -1 : 0;
+}
+
+// Open the published reporting generation and pin it against reclaim
+// with a shared lock, held until the directory is closed. Before the
+// first generation is published this is REPORTING_DIR itself.
+struct storage_dir *reporting_open_snapshot(char *path, size_t size) {
+    struct storage_dir *root = storage->dir_open(REPORTING_DIR);
+    if (!root) {
+        return NULL;
     }
     
-    return 0;
+    for (int attempt = 0; attempt < SNAPSHOT_OPEN_ATTEMPTS; attempt++) {
+        char name[64];
+        if (current_generation(root, name, sizeof(name)) < 0) {
+            snprintf(path, size, "%s", REPORTING_DIR);
+            return root;
+        }
+        
+        snprintf(path, size, "%s/%s", REPORTING_DIR, name);
+        struct storage_dir *dir = storage->dir_open(path);
+        if (!dir) {
+            continue;
+        }
+        
+        // A generation that is still current once the lock is held cannot
+        // be reclaimed. Otherwise it may already be emptied or removed, so
+        // resolve current again.
+        char locked[64];
+        if (storage->dir_trylock(dir, 0) == 0 &&
+            current_generation(root, locked, sizeof(locked)) == 0 &&
+            strcmp(name, locked) == 0) {
+            storage->dir_close(root);
+            return dir;
+        }
+        
+        storage->dir_close(dir);
+    }
+    
+    storage->dir_close(root);
+    errno = EAGAIN;
+    return NULL;
+}
+
+// Copy one reporting file into the backup directory
+static void backup_file(struct storage_dir *dir, const struct storage_entry *entry, void *ctx) {
+    struct scan_context *scan = ctx;
+    
+    trace_begin("file", "copy", entry->name);
+    int copied = storage_copy(dir, entry->name, scan->dst_dir, entry->name, NULL, NULL);
+    trace_end();
+    
+    if (copied < 0) {
+        log_message(LOG_ERR, "Failed to back up %s/%s to %s: %s", scan->src_path, entry->name, scan->dst_path, strerror(errno));
+        return;
+    }
+    
+    log_message(LOG_INFO, "Backed up %s", entry->name);
+    publish_event(EVENT_BACKUP, "Backed up %s", entry->name);
 }
 
 // Backup reporting directory
 int backup_reporting_dir(void) {
     log_message(LOG_INFO, "Starting backup of reporting directory");
+    publish_event(EVENT_BACKUP, "Backup started");
     
     // Create timestamped backup directory
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
     char backup_dir[256];
-    strftime(backup_dir, sizeof(backup_dir), "%s/backup_%Y%m%d_%H%M%S", tm_info);
-    
-    // Create directory
     sprintf(backup_dir, "%s/backup_%d", BACKUP_DIR, (int)now);
-    if (mkdir(backup_dir, 0755) < 0) {
+    if (storage->mkdir(backup_dir, 0755) < 0) {
         log_message(LOG_ERR, "Failed to create backup directory: %s", strerror(errno));
         return -1;
     }
     
-    // Copy files from reporting directory to backup
-    DIR *dir = opendir(REPORTING_DIR);
-    if (!dir) {
+    struct storage_dir *dst_dir = storage->dir_open(backup_dir);
+    if (!dst_dir) {
+        log_message(LOG_ERR, "Failed to open backup directory %s: %s", backup_dir, strerror(errno));
+        return -1;
+    }
+    
+    // Copy files from the published reporting generation to backup
+    char snapshot[512];
+    struct storage_dir *snapshot_dir = reporting_open_snapshot(snapshot, sizeof(snapshot));
+    if (!snapshot_dir) {
         log_message(LOG_ERR, "Failed to open reporting directory: %s", strerror(errno));
+        storage->dir_close(dst_dir);
         return -1;
     }
     
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    struct scan_context scan = {dst_dir, NULL, snapshot, backup_dir, NULL, NULL, 0};
+    if (storage_scan(snapshot, backup_file, &scan) < 0) {
+        log_message(LOG_ERR, "Failed to read reporting directory: %s", strerror(errno));
+        storage->dir_close(snapshot_dir);
+        storage->dir_close(dst_dir);
+        return -1;
+    }
+    
+    storage->dir_close(snapshot_dir);
+    storage->dir_close(dst_dir);
+    log_message(LOG_INFO, "Backup completed to %s", backup_dir);
+    publish_event(EVENT_BACKUP, "Backup completed to %s", backup_dir);
+    
+    return 0;
+}
+
+// Add a copied upload to the transfer, taking over its index entry
+static int record_transfer(struct transfer_list *list, const char *department,
+                           const char *name, struct report_entry *index) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        struct transfer_record *grown = realloc(list->records, cap * sizeof(struct transfer_record));
+        if (!grown) {
+            return -1;
         }
+        list->records = grown;
+        list->cap = cap;
+    }
+    
+    struct transfer_record *record = &list->records[list->count++];
+    record->department = department;
+    snprintf(record->name, sizeof(record->name), "%s", name);
+    record->index = *index;
+    return 0;
+}
+
+// Copy one upload into the new generation. The upload itself is left in
+// place until the generation has been published.
+static void transfer_file(struct storage_dir *dir, const struct storage_entry *entry, void *ctx) {
+    struct scan_context *scan = ctx;
+    
+    // Only process XML files
+    if (strstr(entry->name, ".xml") == NULL) {
+        return;
+    }
+    
+    trace_begin("file", "transfer", entry->name);
+    
+    // Ownership and timestamps are carried over to the copy
+    struct storage_stat st;
+    trace_begin("file", "stat", entry->name);
+    int found = storage->stat_at(dir, entry->name, &st, STORAGE_STAT_OWNER | STORAGE_STAT_SIZE | STORAGE_STAT_TIMES);
+    trace_end();
+    
+    if (found != 0) {
+        log_message(LOG_ERR, "Failed to stat %s/%s: %s", scan->src_path, entry->name, strerror(errno));
+        trace_end();
+        return;
+    }
+    
+    // Copy file to reporting directory, keeping its header for the index.
+    // A report carried over from the previous generation is a hard link,
+    // so it is unlinked first rather than overwritten in place.
+    struct report_header header;
+    header.data[0] = '\0';
+    header.len = 0;
+    
+    trace_begin("file", "copy", entry->name);
+    storage->unlink_at(scan->dst_dir, entry->name);
+    int copied = storage_copy(dir, entry->name, scan->dst_dir, entry->name, report_header_collect, &header);
+    trace_end();
+    
+    if (copied < 0) {
+        log_message(LOG_ERR, "Failed to transfer %s/%s: %s", scan->src_path, entry->name, strerror(errno));
         
-        char src_path[512], dst_path[512];
-        sprintf(src_path, "%s/%s", REPORTING_DIR, entry->d_name);
-        sprintf(dst_path, "%s/%s", backup_dir, entry->d_name);
+        // Keep the previous version of the report in the new generation
+        struct storage_stat base_st;
+        if (scan->base_dir &&
+            storage->stat_at(scan->base_dir, entry->name, &base_st, 0) == 0 &&
+            storage->link_at(scan->base_dir, entry->name, scan->dst_dir, entry->name) < 0) {
+            log_message(LOG_ERR, "Failed to keep the previous %s: %s", entry->name, strerror(errno));
+            scan->failed = 1;
+        }
+        trace_end();
+        return;
+    }
+    
+    // Preserve ownership and timestamp
+    trace_begin("file", "chown", entry->name);
+    storage->chown_at(scan->dst_dir, entry->name, st.uid, st.gid);
+    trace_end();
+    
+    trace_begin("file", "utime", entry->name);
+    storage->utime_at(scan->dst_dir, entry->name, st.atime, st.mtime);
+    trace_end();
+    
+    // The report is shared with later generations, so no one may write it
+    trace_begin("file", "chmod", entry->name);
+    storage->chmod_at(scan->dst_dir, entry->name, REPORT_MODE);
+    trace_end();
+    
+    // Build the index entry now, while the header is at hand
+    struct report_entry index;
+    if (report_index_prepare(&index, entry->name, scan->department, &st, &header) < 0) {
+        index.line = NULL;
+        index.len = 0;
+    }
+    
+    if (record_transfer(scan->pending, scan->department, entry->name, &index) < 0) {
+        log_message(LOG_ERR, "Out of memory transferring %s/%s", scan->src_path, entry->name);
+        report_index_free(&index);
+        scan->failed = 1;
+    }
+    
+    trace_end();
+}
+
+// Index and remove the uploads once their generation is published
+static void finish_transfers(struct transfer_list *list) {
+    struct storage_dir *dir = NULL;
+    const char *dir_department = NULL;
+    
+    for (size_t i = 0; i < list->count; i++) {
+        struct transfer_record *record = &list->records[i];
         
-        // Check if it's a regular file
-        struct stat st;
-        if (stat(src_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-            continue;
+        // Record the report in the daily index
+        if (record->index.line) {
+            trace_begin("file", "index", record->name);
+            report_index_write(&record->index);
+            trace_end();
         }
         
-        // Copy file
-        int src_fd = open(src_path, O_RDONLY);
-        if (src_fd < 0) {
-            log_message(LOG_ERR, "Failed to open source file %s: %s", src_path, strerror(errno));
-            continue;
+        // Log transfer
+        log_message(LOG_INFO, "Transferred %s from %s to reporting directory", record->name, record->department);
+        publish_event(EVENT_TRANSFER, "Transferred %s from %s", record->name, record->department);
+        
+        // Records are grouped by department, so each directory is opened once
+        if (record->department != dir_department) {
+            if (dir) {
+                storage->dir_close(dir);
+            }
+            
+            char dept_dir[256];
+            snprintf(dept_dir, sizeof(dept_dir), "%s/%s", UPLOAD_DIR, record->department);
+            dir = storage->dir_open(dept_dir);
+            dir_department = record->department;
         }
         
-        int dst_fd = open(dst_path, O_WRONLY | O_CREAT, 0644);
-        if (dst_fd < 0) {
-            log_message(LOG_ERR, "Failed to create destination file %s: %s", dst_path, strerror(errno));
-            close(src_fd);
+        // Remove source file
+        trace_begin("file", "unlink", record->name);
+        if (!dir || storage->unlink_at(dir, record->name) < 0) {
+            log_message(LOG_ERR, "Failed to remove upload %s/%s: %s", record->department, record->name, strerror(errno));
+        }
+        trace_end();
+    }
+    
+    if (dir) {
+        storage->dir_close(dir);
+    }
+}
+
+// Drop the transfer list and its index entries
+static void free_transfers(struct transfer_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        report_index_free(&list->records[i].index);
+    }
+    free(list->records);
+    list->records = NULL;
+    list->count = list->cap = 0;
+}
+
+// Carry a report over from the previous generation
+static void link_file(struct storage_dir *dir, const struct storage_entry *entry, void *ctx) {
+    struct scan_context *scan = ctx;
+    
+    // Fall back to a copy where hard links are not possible
+    if (storage->link_at(dir, entry->name, scan->dst_dir, entry->name) < 0 &&
+        storage_copy(dir, entry->name, scan->dst_dir, entry->name, NULL, NULL) < 0) {
+        log_message(LOG_ERR, "Failed to carry %s/%s into %s: %s", scan->src_path, entry->name, scan->dst_path, strerror(errno));
+        scan->failed = 1;
+        return;
+    }
+    
+    // Reports from before generations were used are still writable
+    storage->chmod_at(scan->dst_dir, entry->name, REPORT_MODE);
+}
+
+// Remove a file left in REPORTING_DIR from before generations were used,
+// once the first generation holds its own copy of it
+static void unlink_file(struct storage_dir *dir, const struct storage_entry *entry, void *ctx) {
+    struct scan_context *scan = ctx;
+    
+    struct storage_stat st;
+    if (storage->stat_at(scan->dst_dir, entry->name, &st, 0) < 0) {
+        log_message(LOG_ERR, "Keeping %s/%s, it is missing from %s", scan->src_path, entry->name, scan->dst_path);
+        return;
+    }
+    
+    storage->unlink_at(dir, entry->name);
+}
+
+// Delete a generation unless a reader holds a lock on it. Returns 1 if
+// it was removed.
+static int remove_generation(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", REPORTING_DIR, name);
+    
+    struct storage_dir *dir = storage->dir_open(path);
+    if (!dir) {
+        return 0;
+    }
+    
+    // Readers hold a shared lock while they use a generation
+    if (storage->dir_trylock(dir, 1) < 0) {
+        storage->dir_close(dir);
+        return 0;
+    }
+    
+    storage->chmod(path, 0755);
+    
+    struct storage_entry entry;
+    while (storage->dir_next(dir, &entry) > 0) {
+        storage->unlink_at(dir, entry.name);
+    }
+    
+    int removed = storage->rmdir(path) == 0;
+    if (!removed) {
+        log_message(LOG_ERR, "Failed to remove reporting generation %s: %s", path, strerror(errno));
+    }
+    
+    storage->dir_close(dir);
+    return removed;
+}
+
+// Reclaim every generation other than the published one
+static void reclaim_generations(const char *current) {
+    struct storage_dir *root = storage->dir_open(REPORTING_DIR);
+    if (!root) {
+        return;
+    }
+    
+    struct storage_entry entry;
+    while (storage->dir_next(root, &entry) > 0) {
+        if (entry.type == STORAGE_FILE ||
+            strncmp(entry.name, GENERATION_PREFIX, strlen(GENERATION_PREFIX)) != 0 ||
+            strcmp(entry.name, current) == 0) {
             continue;
         }
         
-        // Copy data
-        char buffer[4096];
-        ssize_t bytes_read;
-        while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
-            write(dst_fd, buffer, bytes_read);
+        if (remove_generation(entry.name)) {
+            log_message(LOG_INFO, "Reclaimed reporting generation %s", entry.name);
+        } else {
+            log_message(LOG_INFO, "Reporting generation %s is still in use, keeping it", entry.name);
         }
-        
-        close(src_fd);
-        close(dst_fd);
-        
-        log_message(LOG_INFO, "Backed up %s", entry->d_name);
     }
     
-    closedir(dir);
-    log_message(LOG_INFO, "Backup completed to %s", backup_dir);
+    storage->dir_close(root);
+}
+
+// Find the highest generation number in REPORTING_DIR
+static int newest_generation(void) {
+    struct storage_dir *root = storage->dir_open(REPORTING_DIR);
+    if (!root) {
+        return 0;
+    }
+    
+    int newest = 0;
+    struct storage_entry entry;
+    while (storage->dir_next(root, &entry) > 0) {
+        int number;
+        if (sscanf(entry.name, GENERATION_PREFIX "%d", &number) == 1 && number > newest) {
+            newest = number;
+        }
+    }
+    
+    storage->dir_close(root);
+    return newest;
+}
+
+// Point REPORTING_DIR/current at a generation in a single rename
+static int publish_generation(struct storage_dir *root, const char *name) {
+    storage->unlink_at(root, REPORTING_CURRENT ".tmp");
     
+    if (storage->symlink_at(name, root, REPORTING_CURRENT ".tmp") < 0 ||
+        storage->rename_at(root, REPORTING_CURRENT ".tmp", root, REPORTING_CURRENT) < 0) {
+        log_message(LOG_ERR, "Failed to publish reporting generation %s: %s", name, strerror(errno));
+        storage->unlink_at(root, REPORTING_CURRENT ".tmp");
+        return -1;
+    }
+    
+    log_message(LOG_INFO, "Published reporting generation %s", name);
+    publish_event(EVENT_TRANSFER, "Published reporting generation %s", name);
     return 0;
 }
 
 // Transfer files from upload directory to reporting directory
 int transfer_uploads(void) {
     log_message(LOG_INFO, "Starting transfer of uploads");
+    publish_event(EVENT_TRANSFER, "Transfer started");
+    
+    struct storage_dir *root = storage->dir_open(REPORTING_DIR);
+    if (!root) {
+        log_message(LOG_ERR, "Failed to open reporting directory: %s", strerror(errno));
+        return -1;
+    }
+    
+    // The new generation starts from the published one. Until the first
+    // generation exists the reports sit directly in REPORTING_DIR.
+    char current[64];
+    char base_path[512];
+    int legacy = current_generation(root, current, sizeof(current)) < 0;
+    if (legacy) {
+        current[0] = '\0';
+        snprintf(base_path, sizeof(base_path), "%s", REPORTING_DIR);
+    } else {
+        snprintf(base_path, sizeof(base_path), "%s/%s", REPORTING_DIR, current);
+    }
+    
+    char gen_name[64];
+    char gen_path[512];
+    snprintf(gen_name, sizeof(gen_name), GENERATION_PREFIX "%06d", newest_generation() + 1);
+    snprintf(gen_path, sizeof(gen_path), "%s/%s", REPORTING_DIR, gen_name);
+    
+    if (storage->mkdir(gen_path, 0755) < 0) {
+        log_message(LOG_ERR, "Failed to create reporting generation %s: %s", gen_path, strerror(errno));
+        storage->dir_close(root);
+        return -1;
+    }
+    
+    struct storage_dir *dst_dir = storage->dir_open(gen_path);
+    struct storage_dir *base_dir = storage->dir_open(base_path);
+    if (!dst_dir || !base_dir) {
+        log_message(LOG_ERR, "Failed to open reporting generation: %s", strerror(errno));
+        if (dst_dir) {
+            storage->dir_close(dst_dir);
+        }
+        if (base_dir) {
+            storage->dir_close(base_dir);
+        }
+        storage->rmdir(gen_path);
+        storage->dir_close(root);
+        return -1;
+    }
+    
+    // Carry the published reports over as hard links
+    trace_begin("generation", "link", gen_name);
+    struct scan_context carry = {dst_dir, NULL, base_path, gen_path, NULL, NULL, 0};
+    if (storage_scan(base_path, link_file, &carry) < 0) {
+        log_message(LOG_ERR, "Failed to read reporting directory %s: %s", base_path, strerror(errno));
+        carry.failed = 1;
+    }
+    trace_end();
     
     const char *departments[] = {"warehouse", "manufacturing", "sales", "distribution", NULL};
+    struct transfer_list pending = {NULL, 0, 0};
+    int failed = carry.failed;
     
-    for (int i = 0; departments[i] != NULL; i++) {
+    for (int i = 0; departments[i] != NULL && !failed; i++) {
         char dept_dir[256];
         sprintf(dept_dir, "%s/%s", UPLOAD_DIR, departments[i]);
         
-        DIR *dir = opendir(dept_dir);
-        if (!dir) {
-            log_message(LOG_ERR, "Failed to open department directory %s: %s", dept_dir, strerror(errno));
-            continue;
-        }
+        trace_begin("department", departments[i], dept_dir);
         
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-            
-            // Only process XML files
-            if (strstr(entry->d_name, ".xml") == NULL) {
-                continue;
-            }
-            
-            char src_path[512], dst_path[512];
-            sprintf(src_path, "%s/%s", dept_dir, entry->d_name);
-            sprintf(dst_path, "%s/%s", REPORTING_DIR, entry->d_name);
-            
-            // Check if it's a regular file
-            struct stat st;
-            if (stat(src_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-                continue;
-            }
-            
-            // Copy file to reporting directory
-            int src_fd = open(src_path, O_RDONLY);
-            if (src_fd < 0) {
-                log_message(LOG_ERR, "Failed to open source file %s: %s", src_path, strerror(errno));
-                continue;
-            }
-            
-            int dst_fd = open(dst_path, O_WRONLY | O_CREAT, 0644);
-            if (dst_fd < 0) {
-                log_message(LOG_ERR, "Failed to create destination file %s: %s", dst_path, strerror(errno));
-                close(src_fd);
-                continue;
-            }
-            
-            // Copy data
-            char buffer[4096];
-            ssize_t bytes_read;
-            while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
-                write(dst_fd, buffer, bytes_read);
-            }
-            
-            close(src_fd);
-            close(dst_fd);
-            
-            // Preserve ownership and timestamp
-            chown(dst_path, st.st_uid, st.st_gid);
-            
-            struct utimbuf utb;
-            utb.actime = st.st_atime;
-            utb.modtime = st.st_mtime;
-            utime(dst_path, &utb);
-            
-            // Log transfer
-            log_message(LOG_INFO, "Transferred %s from %s to reporting directory", entry->d_name, departments[i]);
-            
-            // Remove source file
-            unlink(src_path);
+        struct scan_context scan = {dst_dir, base_dir, dept_dir, gen_path, departments[i], &pending, 0};
+        if (storage_scan(dept_dir, transfer_file, &scan) < 0) {
+            log_message(LOG_ERR, "Failed to read department directory %s: %s", dept_dir, strerror(errno));
         }
+        failed |= scan.failed;
         
-        closedir(dir);
+        trace_end();
+    }
+    
+    storage->dir_close(base_dir);
+    
+    // Publishing a generation that lacks a report would lose it once the
+    // current one is reclaimed. Keep current and the uploads for next time.
+    if (failed) {
+        log_message(LOG_ERR, "Reporting generation %s is incomplete, not publishing it", gen_name);
+        storage->dir_close(dst_dir);
+        remove_generation(gen_name);
+        storage->dir_close(root);
+        free_transfers(&pending);
+        return -1;
+    }
+    
+    // Nothing new to publish, readers keep the current generation. Older
+    // generations a reader was holding last time may be free by now.
+    if (pending.count == 0 && !legacy) {
+        storage->dir_close(dst_dir);
+        remove_generation(gen_name);
+        storage->dir_close(root);
+        
+        trace_begin("generation", "reclaim", current);
+        reclaim_generations(current);
+        trace_end();
+        
+        log_message(LOG_INFO, "Transfer completed, no new reports");
+        publish_event(EVENT_TRANSFER, "Transfer completed");
+        return 0;
+    }
+    
+    // A published generation is never modified again
+    storage->chmod(gen_path, 0555);
+    
+    trace_begin("generation", "publish", gen_name);
+    int published = publish_generation(root, gen_name);
+    trace_end();
+    
+    if (published < 0) {
+        storage->dir_close(dst_dir);
+        remove_generation(gen_name);
+        storage->dir_close(root);
+        free_transfers(&pending);
+        return -1;
+    }
+    
+    // Only now that the reports are visible can the uploads go
+    finish_transfers(&pending);
+    free_transfers(&pending);
+    
+    // The flat reports now live in the first generation. Any that could
+    // not be carried over stay where they are.
+    if (legacy) {
+        struct scan_context cleanup = {dst_dir, NULL, REPORTING_DIR, gen_path, NULL, NULL, 0};
+        storage_scan(REPORTING_DIR, unlink_file, &cleanup);
     }
+    storage->dir_close(dst_dir);
+    storage->dir_close(root);
+    
+    trace_begin("generation", "reclaim", gen_name);
+    reclaim_generations(gen_name);
+    trace_end();
     
     log_message(LOG_INFO, "Transfer completed");
+    publish_event(EVENT_TRANSFER, "Transfer completed");
     return 0;
 }
 
@@ -244,35 +659,83 @@ int check_missing_uploads(void) {
     char date_str[64];
     strftime(date_str, sizeof(date_str), "%Y%m%d", tm_info);
     
+    // Look in the generation readers see
+    char snapshot[512];
+    struct storage_dir *dir = reporting_open_snapshot(snapshot, sizeof(snapshot));
+    if (!dir) {
+        log_message(LOG_ERR, "Failed to open reporting directory: %s", strerror(errno));
+        return -1;
+    }
+    
     const char *departments[] = {"warehouse", "manufacturing", "sales", "distribution", NULL};
     
     for (int i = 0; departments[i] != NULL; i++) {
         char expected_file[256];
         sprintf(expected_file, "%s_%s.xml", departments[i], date_str);
         
-        char file_path[512];
-        sprintf(file_path, "%s/%s", REPORTING_DIR, expected_file);
-        
         // Check if file exists
-        if (access(file_path, F_OK) != 0) {
+        struct storage_stat st;
+        if (storage->stat_at(dir, expected_file, &st, 0) != 0) {
             log_message(LOG_ERR, "Missing upload from department %s: %s", departments[i], expected_file);
         }
     }
     
+    storage->dir_close(dir);
     return 0;
 }
 
+// Record a change to one upload if it was modified since the last check
+static void monitor_file(struct storage_dir *dir, const struct storage_entry *entry, void *ctx) {
+    struct scan_context *scan = ctx;
+    
+    struct storage_stat st;
+    trace_begin("file", "stat", entry->name);
+    int found = storage->stat_at(dir, entry->name, &st, STORAGE_STAT_OWNER | STORAGE_STAT_TIMES);
+    trace_end();
+    
+    if (found != 0) {
+        return;
+    }
+    
+    // If file was modified since last check
+    if (st.mtime > monitor_last_check - 300) {
+        char file_path[512];
+        snprintf(file_path, sizeof(file_path), "%s/%s", scan->src_path, entry->name);
+        
+        // Get user name from UID
+        trace_begin("nss", "getpwuid", entry->name);
+        struct passwd *pw = getpwuid(st.uid);
+        char *username = pw ? pw->pw_name : "unknown";
+        trace_end();
+        
+        // Log change
+        trace_begin("log", "change log", entry->name);
+        FILE *log_file = fopen(CHANGE_LOG, "a");
+        if (log_file) {
+            char timestamp[64];
+            struct tm *tm_info = localtime(&st.mtime);
+            strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+            
+            fprintf(log_file, "[%s] User '%s' modified file '%s'\n", timestamp, username, file_path);
+            fclose(log_file);
+        }
+        trace_end();
+        
+        publish_event(EVENT_CHANGE, "User '%s' modified file '%s'", username, file_path);
+    }
+}
+
 // Monitor uploads directory for changes
 void monitor_uploads(void) {
-    static time_t last_check = 0;
     time_t now = time(NULL);
     
     // Only check every 5 minutes
-    if (now - last_check < 300) {
+    if (now - monitor_last_check < 300) {
         return;
     }
     
-    last_check = now;
+    monitor_last_check = now;
+    trace_session_begin("monitor");
     
     const char *departments[] = {"warehouse", "manufacturing", "sales", "distribution", NULL};
     
@@ -280,44 +743,11 @@ void monitor_uploads(void) {
         char dept_dir[256];
         sprintf(dept_dir, "%s/%s", UPLOAD_DIR, departments[i]);
         
-        DIR *dir = opendir(dept_dir);
-        if (!dir) {
-            continue;
-        }
-        
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-            
-            char file_path[512];
-            sprintf(file_path, "%s/%s", dept_dir, entry->d_name);
-            
-            struct stat st;
-            if (stat(file_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-                continue;
-            }
-            
-            // If file was modified since last check
-            if (st.st_mtime > last_check - 300) {
-                // Get user name from UID
-                struct passwd *pw = getpwuid(st.st_uid);
-                char *username = pw ? pw->pw_name : "unknown";
-                
-                // Log change
-                FILE *log_file = fopen(CHANGE_LOG, "a");
-                if (log_file) {
-                    char timestamp[64];
-                    struct tm *tm_info = localtime(&st.st_mtime);
-                    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-                    
-                    fprintf(log_file, "[%s] User '%s' modified file '%s'\n", timestamp, username, file_path);
-                    fclose(log_file);
-                }
-            }
-        }
-        
-        closedir(dir);
+        trace_begin("department", departments[i], dept_dir);
+        struct scan_context scan = {NULL, NULL, dept_dir, NULL, departments[i], NULL, 0};
+        storage_scan(dept_dir, monitor_file, &scan);
+        trace_end();
     }
+    
+    trace_session_end();
 }
\ No newline at end of file
@@ -1,46 +1,127 @@
 #include "../include/company.h"
-#include <sys/ipc.h>
-#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdarg.h>
 
-// Set up IPC message queue
-int setup_ipc(void) {
-    // Create key for message queue
-    key_t key = ftok("/var/company", 'A');
-    if (key == -1) {
-        log_message(LOG_ERR, "Failed to create IPC key: %s", strerror(errno));
+// Event ring mapped into this process, NULL until setup_ipc() succeeds
+static struct event_ring *ring = NULL;
+
+// Reopen the ring left by the previous instance. /dev/shm is world
+// writable, so the object is only trusted if this user created it, no
+// one else can write to it, and it is the full size of the ring.
+static int reopen_ring(void) {
+    int fd = shm_open(EVENT_RING_NAME, O_RDWR, 0);
+    if (fd < 0) {
         return -1;
     }
     
-    // Create message queue
-    int msgid = msgget(key, 0666 | IPC_CREAT);
-    if (msgid == -1) {
-        log_message(LOG_ERR, "Failed to create message queue: %s", strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        st.st_uid != geteuid() ||
+        (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+        st.st_size != (off_t)sizeof(struct event_ring)) {
+        log_message(LOG_ERR, "Event ring %s is not trusted, creating a new one", EVENT_RING_NAME);
+        close(fd);
         return -1;
     }
     
-    log_message(LOG_INFO, "IPC message queue created with ID %d", msgid);
-    return msgid;
+    return fd;
 }
 
-// Send a message to the queue
-int send_message(int msgid, long type, const char *msg) {
-    struct msg_buffer message;
-    message.msg_type = type;
-    strncpy(message.msg_text, msg, sizeof(message.msg_text) - 1);
-    message.msg_text[sizeof(message.msg_text) - 1] = '\0';
-    
-    if (msgsnd(msgid, &message, sizeof(message.msg_text), IPC_NOWAIT) == -1) {
-        log_message(LOG_ERR, "Failed to send message: %s", strerror(errno));
+// Set up the shared memory event ring. On a handover the previous
+// instance's ring is kept so subscribers keep their position; otherwise
+// whatever is there is removed and a new ring is created.
+int setup_ipc(int reuse) {
+    int fd = reuse ? reopen_ring() : -1;
+    if (fd < 0) {
+        shm_unlink(EVENT_RING_NAME);
+        fd = shm_open(EVENT_RING_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            log_message(LOG_ERR, "Failed to create event ring: %s", strerror(errno));
+            return -1;
+        }
+        
+        // Stay clear of the process umask
+        fchmod(fd, 0644);
+    }
+    
+    if (ftruncate(fd, sizeof(struct event_ring)) < 0) {
+        log_message(LOG_ERR, "Failed to size event ring: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    void *addr = mmap(NULL, sizeof(struct event_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        log_message(LOG_ERR, "Failed to map event ring: %s", strerror(errno));
         return -1;
     }
     
+    ring = addr;
+    
+    // Initialise the ring unless it already holds a compatible layout,
+    // in which case subscribers keep their position across a restart
+    if (ring->magic != EVENT_RING_MAGIC ||
+        ring->version != EVENT_RING_VERSION ||
+        ring->slots != EVENT_RING_SLOTS ||
+        ring->slot_size != sizeof(struct event_slot)) {
+        memset(ring, 0, sizeof(struct event_ring));
+        ring->version = EVENT_RING_VERSION;
+        ring->slots = EVENT_RING_SLOTS;
+        ring->slot_size = sizeof(struct event_slot);
+        atomic_thread_fence(memory_order_release);
+        ring->magic = EVENT_RING_MAGIC;
+    }
+    
+    log_message(LOG_INFO, "Event ring %s mapped at sequence %llu", EVENT_RING_NAME,
+                (unsigned long long)atomic_load(&ring->head));
     return 0;
 }
 
+// Publish an event to all subscribers. The daemon is the only producer,
+// so a slot is claimed without any atomic read-modify-write.
+void publish_event(int type, const char *format, ...) {
+    if (!ring) {
+        return;
+    }
+    
+    uint64_t seq = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct event_slot *slot = &ring->slot[seq & (EVENT_RING_SLOTS - 1)];
+    
+    // Mark the slot as being rewritten before touching its payload
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    
+    slot->timestamp = time(NULL);
+    slot->type = type;
+    slot->pid = getpid();
+    
+    // Commit the slot, then make it visible through the head
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, seq + 1, memory_order_release);
+}
+
+// Unmap the event ring but leave it in place for the next instance
+void detach_ipc(void) {
+    if (ring) {
+        munmap(ring, sizeof(struct event_ring));
+        ring = NULL;
+        log_message(LOG_INFO, "Event ring detached");
+    }
+}
+
 // Clean up IPC resources
-void cleanup_ipc(int msgid) {
-    if (msgid != -1) {
-        msgctl(msgid, IPC_RMID, NULL);
-        log_message(LOG_INFO, "IPC message queue removed");
+void cleanup_ipc(void) {
+    if (ring) {
+        munmap(ring, sizeof(struct event_ring));
+        ring = NULL;
+        shm_unlink(EVENT_RING_NAME);
+        log_message(LOG_INFO, "Event ring removed");
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,237 @@
+#include "../include/company.h"
+#include <ctype.h>
+#include <stdarg.h>
+
+// Longest header value kept in the index
+#define INDEX_VALUE_SIZE 256
+
+// Keep the start of a report as it streams past during the copy
+void report_header_collect(const char *data, size_t len, void *ctx) {
+    struct report_header *header = ctx;
+    size_t room = sizeof(header->data) - 1 - header->len;
+    if (len > room) {
+        len = room;
+    }
+    
+    memcpy(header->data + header->len, data, len);
+    header->len += len;
+    header->data[header->len] = '\0';
+}
+
+// Find the text of the first <field> element in the header
+static int find_field(const char *xml, const char *field, char *value, size_t size) {
+    char open_tag[128];
+    snprintf(open_tag, sizeof(open_tag), "<%s", field);
+    size_t tag_len = strlen(open_tag);
+    
+    // Skip elements whose name merely starts with the field name
+    const char *p = xml;
+    while ((p = strstr(p, open_tag)) != NULL) {
+        p += tag_len;
+        if (*p == '>' || *p == '/' || isspace((unsigned char)*p)) {
+            break;
+        }
+    }
+    if (!p) {
+        return 0;
+    }
+    
+    const char *start = strchr(p, '>');
+    if (!start) {
+        return 0;
+    }
+    
+    // <field/> has no text
+    if (start[-1] == '/') {
+        value[0] = '\0';
+        return 1;
+    }
+    start++;
+    
+    // The value must end inside the captured header
+    const char *end = strchr(start, '<');
+    if (!end) {
+        return 0;
+    }
+    
+    while (start < end && isspace((unsigned char)*start)) {
+        start++;
+    }
+    while (end > start && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    
+    size_t len = end - start;
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    memcpy(value, start, len);
+    value[len] = '\0';
+    return 1;
+}
+
+// Append formatted text to a line, failing once the line is full
+static int append(char *line, size_t *len, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line + *len, size - *len, format, args);
+    va_end(args);
+    
+    if (n < 0 || (size_t)n >= size - *len) {
+        return -1;
+    }
+    
+    *len += n;
+    return 0;
+}
+
+// Append a string as a JSON string literal
+static int append_json_string(char *line, size_t *len, size_t size, const char *s) {
+    if (append(line, len, size, "\"") < 0) {
+        return -1;
+    }
+    
+    for (; *s; s++) {
+        unsigned char c = *s;
+        int result;
+        if (c == '"' || c == '\\') {
+            result = append(line, len, size, "\\%c", c);
+        } else if (c < 0x20) {
+            result = append(line, len, size, "\\u%04x", c);
+        } else {
+            result = append(line, len, size, "%c", c);
+        }
+        
+        if (result < 0) {
+            return -1;
+        }
+    }
+    
+    return append(line, len, size, "\"");
+}
+
+// Work out which day a report belongs to: the date in names such as
+// sales_20240131.xml, otherwise the day it was last modified
+static void report_day(const char *name, time_t mtime, char *day, size_t size) {
+    const char *suffix = strstr(name, ".xml");
+    if (suffix && suffix - name >= 9 && suffix[-9] == '_') {
+        int digits = 1;
+        for (int i = 8; i >= 1; i--) {
+            if (!isdigit((unsigned char)suffix[-i])) {
+                digits = 0;
+                break;
+            }
+        }
+        
+        if (digits) {
+            snprintf(day, size, "%.8s", suffix - 8);
+            return;
+        }
+    }
+    
+    struct tm *tm_info = localtime(&mtime);
+    strftime(day, size, "%Y%m%d", tm_info);
+}
+
+// Build the index entry for a transferred report while its header is at
+// hand. Nothing is written until report_index_write().
+int report_index_prepare(struct report_entry *entry, const char *name, const char *department,
+                         const struct storage_stat *st, const struct report_header *header) {
+    char line[4096];
+    size_t len = 0;
+    entry->line = NULL;
+    entry->len = 0;
+    
+    int result = append(line, &len, sizeof(line), "{\"file\":");
+    result |= append_json_string(line, &len, sizeof(line), name);
+    result |= append(line, &len, sizeof(line), ",\"department\":");
+    result |= append_json_string(line, &len, sizeof(line), department);
+    result |= append(line, &len, sizeof(line), ",\"size\":%lld,\"mtime\":%lld,\"transferred\":%lld,\"fields\":{",
+                     (long long)st->size, (long long)st->mtime, (long long)time(NULL));
+    
+    // Extract each configured header field
+    const char *configured = getenv(INDEX_FIELDS_ENV);
+    char fields[512];
+    snprintf(fields, sizeof(fields), "%s", configured && *configured ? configured : INDEX_FIELDS);
+    char *saveptr;
+    int first = 1;
+    for (char *field = strtok_r(fields, ",", &saveptr); field; field = strtok_r(NULL, ",", &saveptr)) {
+        char value[INDEX_VALUE_SIZE];
+        if (!find_field(header->data, field, value, sizeof(value))) {
+            continue;
+        }
+        
+        if (!first) {
+            result |= append(line, &len, sizeof(line), ",");
+        }
+        result |= append_json_string(line, &len, sizeof(line), field);
+        result |= append(line, &len, sizeof(line), ":");
+        result |= append_json_string(line, &len, sizeof(line), value);
+        first = 0;
+    }
+    
+    result |= append(line, &len, sizeof(line), "}}\n");
+    if (result < 0) {
+        log_message(LOG_ERR, "Index entry for %s is too long", name);
+        return -1;
+    }
+    
+    entry->line = malloc(len);
+    if (!entry->line) {
+        log_message(LOG_ERR, "Out of memory indexing %s", name);
+        return -1;
+    }
+    
+    memcpy(entry->line, line, len);
+    entry->len = len;
+    report_day(name, st->mtime, entry->day, sizeof(entry->day));
+    return 0;
+}
+
+// Release an entry built by report_index_prepare()
+void report_index_free(struct report_entry *entry) {
+    free(entry->line);
+    entry->line = NULL;
+    entry->len = 0;
+}
+
+// Append an entry to its day's index. Each entry is one JSON line written
+// with a single append, so readers never see half an entry; when a report
+// is transferred again the later line supersedes it.
+int report_index_write(const struct report_entry *entry) {
+    char file_name[32];
+    char path[256];
+    snprintf(file_name, sizeof(file_name), "%s.jsonl", entry->day);
+    snprintf(path, sizeof(path), "%s/%s", INDEX_DIR, file_name);
+    
+    // The index lives in the same storage backend as the reports
+    struct storage_dir *dir = storage->dir_open(INDEX_DIR);
+    if (!dir && errno == ENOENT && storage->mkdir(INDEX_DIR, 0755) == 0) {
+        dir = storage->dir_open(INDEX_DIR);
+    }
+    if (!dir) {
+        log_message(LOG_ERR, "Failed to open index directory %s: %s", INDEX_DIR, strerror(errno));
+        return -1;
+    }
+    
+    int fd = storage->open_at(dir, file_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        log_message(LOG_ERR, "Failed to open index %s: %s", path, strerror(errno));
+        storage->dir_close(dir);
+        return -1;
+    }
+    
+    int result = 0;
+    if (storage->write(fd, entry->line, entry->len) != (ssize_t)entry->len) {
+        log_message(LOG_ERR, "Failed to write index %s: %s", path, strerror(errno));
+        result = -1;
+    }
+    
+    if (storage->close(fd) < 0 && result == 0) {
+        log_message(LOG_ERR, "Failed to write index %s: %s", path, strerror(errno));
+        result = -1;
+    }
+    
+    storage->dir_close(dir);
+    return result;
+}
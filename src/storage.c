@@ -0,0 +1,135 @@
+#include "../include/company.h"
+
+// Backend used by the file operations
+const struct storage_ops *storage = &posix_storage;
+
+// Look up a backend by name
+const struct storage_ops *storage_find(const char *name) {
+    const struct storage_ops *backends[] = {&posix_storage, &memory_storage, NULL};
+    
+    for (int i = 0; backends[i] != NULL; i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    
+    return NULL;
+}
+
+// Switch the file operations to another backend
+void storage_use(const struct storage_ops *ops) {
+    storage = ops;
+    log_message(LOG_INFO, "Using %s storage backend", ops->name);
+}
+
+// Call fn for every regular file in a directory. The entry type from the
+// listing is trusted, so only entries the backend cannot classify (such
+// as symlinks) cost a stat.
+int storage_scan(const char *path, storage_scan_fn fn, void *ctx) {
+    struct storage_dir *dir = storage->dir_open(path);
+    if (!dir) {
+        return -1;
+    }
+    
+    struct storage_entry entry;
+    int result;
+    while ((result = storage->dir_next(dir, &entry)) > 0) {
+        if (entry.type == STORAGE_UNKNOWN) {
+            struct storage_stat st;
+            if (storage->stat_at(dir, entry.name, &st, 0) != 0) {
+                continue;
+            }
+            entry.type = S_ISREG(st.mode) ? STORAGE_FILE : STORAGE_OTHER;
+        }
+        
+        if (entry.type == STORAGE_FILE) {
+            fn(dir, &entry, ctx);
+        }
+    }
+    
+    int saved_errno = errno;
+    storage->dir_close(dir);
+    errno = saved_errno;
+    return result;
+}
+
+// Write a whole buffer, carrying on after short writes
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = storage->write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        
+        buf += written;
+        len -= written;
+    }
+    
+    return 0;
+}
+
+// Copy a file between two open directories, passing each chunk to
+// observe if given. On failure the partial destination is removed and
+// errno describes the first error.
+int storage_copy(struct storage_dir *src_dir, const char *src_name,
+                 struct storage_dir *dst_dir, const char *dst_name,
+                 storage_copy_fn observe, void *ctx) {
+    if (storage->copy_at && !observe) {
+        return storage->copy_at(src_dir, src_name, dst_dir, dst_name);
+    }
+    
+    int src_fd = storage->open_at(src_dir, src_name, O_RDONLY, 0);
+    if (src_fd < 0) {
+        return -1;
+    }
+    
+    int dst_fd = storage->open_at(dst_dir, dst_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst_fd < 0) {
+        int saved_errno = errno;
+        storage->close(src_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    // Copy data
+    char buffer[65536];
+    ssize_t bytes_read;
+    int result = 0;
+    while ((bytes_read = storage->read(src_fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        
+        if (write_all(dst_fd, buffer, bytes_read) < 0) {
+            result = -1;
+            break;
+        }
+        
+        if (observe) {
+            observe(buffer, bytes_read, ctx);
+        }
+    }
+    
+    int saved_errno = errno;
+    storage->close(src_fd);
+    
+    // Errors such as EIO or ENOSPC may only surface on close
+    if (storage->close(dst_fd) < 0 && result == 0) {
+        saved_errno = errno;
+        result = -1;
+    }
+    
+    if (result < 0) {
+        storage->unlink_at(dst_dir, dst_name);
+        errno = saved_errno;
+    }
+    
+    return result;
+}
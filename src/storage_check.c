@@ -0,0 +1,340 @@
+#include "../include/company.h"
+
+// Reports per transfer and transfers run by the benchmark
+#define BENCH_FILES 2000
+#define BENCH_ROUNDS 10
+
+static int failures = 0;
+static int logged_errors = 0;
+
+// Record the outcome of one check
+static void check(int ok, const char *what) {
+    printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Keep log messages out of syslog and the daemon's error log. Injected
+// faults are expected to log errors, so they are only counted.
+static void log_sink(int priority, const char *message) {
+    (void)message;
+    if (priority == LOG_ERR) {
+        logged_errors++;
+    }
+}
+
+// Read a file from the storage backend, returning its length or -1
+static ssize_t read_file(const char *path, char *buf, size_t size) {
+    char dir_path[512];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    char *slash = strrchr(dir_path, '/');
+    *slash = '\0';
+    
+    struct storage_dir *dir = storage->dir_open(dir_path);
+    if (!dir) {
+        return -1;
+    }
+    
+    int fd = storage->open_at(dir, slash + 1, O_RDONLY, 0);
+    if (fd < 0) {
+        storage->dir_close(dir);
+        return -1;
+    }
+    
+    size_t len = 0;
+    ssize_t n;
+    while (len < size && (n = storage->read(fd, buf + len, size - len)) > 0) {
+        len += n;
+    }
+    
+    storage->close(fd);
+    storage->dir_close(dir);
+    return len;
+}
+
+// Nonzero if path holds exactly the given contents
+static int has_contents(const char *path, const char *data, size_t len) {
+    static char buf[1 << 20];
+    ssize_t n = read_file(path, buf, sizeof(buf));
+    return n == (ssize_t)len && memcmp(buf, data, len) == 0;
+}
+
+// Start from an empty tree with the daemon's directories in place
+static void seed_tree(void) {
+    memory_storage_reset();
+    
+    const char *dirs[] = {"/var", "/var/company", UPLOAD_DIR,
+                          UPLOAD_DIR "/warehouse", UPLOAD_DIR "/manufacturing",
+                          UPLOAD_DIR "/sales", UPLOAD_DIR "/distribution",
+                          REPORTING_DIR, BACKUP_DIR, NULL};
+    for (int i = 0; dirs[i] != NULL; i++) {
+        storage->mkdir(dirs[i], 0755);
+    }
+}
+
+// Put an upload in a department directory
+static void put_upload(const char *department, const char *name, const char *data, size_t len) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", UPLOAD_DIR, department, name);
+    memory_storage_put(path, data, len, 1000, 1000, time(NULL));
+}
+
+// Build the path of a report in the published generation
+static void published_path(const char *name, char *path, size_t size) {
+    char snapshot[512];
+    struct storage_dir *dir = reporting_open_snapshot(snapshot, sizeof(snapshot));
+    if (dir) {
+        storage->dir_close(dir);
+    } else {
+        snprintf(snapshot, sizeof(snapshot), "%s", REPORTING_DIR);
+    }
+    snprintf(path, size, "%s/%s", snapshot, name);
+}
+
+// Transfer a report and check it survives a storage fault, injected
+// once the first after calls of op have succeeded
+static void check_fault(int op, int err, unsigned after, const char *what) {
+    seed_tree();
+    
+    const char *report = "<report><date>20240101</date></report>\n";
+    put_upload("sales", "sales_20240101.xml", report, strlen(report));
+    
+    memory_storage_fail(op, err, after, 1);
+    transfer_uploads();
+    
+    char upload[512];
+    char published[512];
+    snprintf(upload, sizeof(upload), "%s/sales/sales_20240101.xml", UPLOAD_DIR);
+    published_path("sales_20240101.xml", published, sizeof(published));
+    
+    char label[128];
+    snprintf(label, sizeof(label), "%s keeps the upload", what);
+    check(has_contents(upload, report, strlen(report)), label);
+    
+    snprintf(label, sizeof(label), "%s publishes no partial report", what);
+    check(storage->exists(published) != 0, label);
+}
+
+// Count the entries in a day's index
+static int index_entries(const char *day) {
+    static char index[65536];
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.jsonl", INDEX_DIR, day);
+    
+    ssize_t len = read_file(path, index, sizeof(index));
+    int entries = 0;
+    for (ssize_t i = 0; i < len; i++) {
+        entries += index[i] == '\n';
+    }
+    return entries;
+}
+
+// Transfer one report of every department and back it up
+static void check_transfer(void) {
+    seed_tree();
+    
+    const char *departments[] = {"warehouse", "manufacturing", "sales", "distribution", NULL};
+    for (int i = 0; departments[i] != NULL; i++) {
+        char name[128];
+        char data[256];
+        snprintf(name, sizeof(name), "%s_20240101.xml", departments[i]);
+        snprintf(data, sizeof(data), "<report><department>%s</department></report>\n", departments[i]);
+        put_upload(departments[i], name, data, strlen(data));
+    }
+    
+    check(transfer_uploads() == 0, "transfer succeeds");
+    
+    int published = 1;
+    int removed = 1;
+    for (int i = 0; departments[i] != NULL; i++) {
+        char name[128];
+        char data[256];
+        char path[512];
+        snprintf(name, sizeof(name), "%s_20240101.xml", departments[i]);
+        snprintf(data, sizeof(data), "<report><department>%s</department></report>\n", departments[i]);
+        
+        published_path(name, path, sizeof(path));
+        published &= has_contents(path, data, strlen(data));
+        
+        snprintf(path, sizeof(path), "%s/%s/%s", UPLOAD_DIR, departments[i], name);
+        removed &= storage->exists(path) != 0;
+    }
+    check(published, "every report is published");
+    check(removed, "every upload is removed");
+    
+    // The index is kept in the same backend as the reports
+    check(index_entries("20240101") == 4, "every report is indexed");
+    
+    check(backup_reporting_dir() == 0, "backup succeeds");
+}
+
+// Copy a large report through writes capped at a few bytes
+static void check_short_writes(void) {
+    seed_tree();
+    
+    static char report[100000];
+    for (size_t i = 0; i < sizeof(report); i++) {
+        report[i] = 'a' + i % 26;
+    }
+    put_upload("sales", "sales_20240101.xml", report, sizeof(report));
+    
+    memory_storage_short_writes(7);
+    transfer_uploads();
+    memory_storage_short_writes(0);
+    
+    char path[512];
+    published_path("sales_20240101.xml", path, sizeof(path));
+    check(has_contents(path, report, sizeof(report)), "short writes copy the whole report");
+}
+
+// Move flat reports from before generations into the first one, first
+// while neither a hard link nor a copy of one of them can be made
+static void check_migration(void) {
+    seed_tree();
+    
+    const char *kept = "<report><date>20240101</date></report>\n";
+    memory_storage_put(REPORTING_DIR "/old_20240101.xml", kept, strlen(kept), 0, 0, time(NULL));
+    
+    const char *report = "<report><date>20240102</date></report>\n";
+    put_upload("sales", "sales_20240102.xml", report, strlen(report));
+    
+    memory_storage_fail(MEMORY_FAULT_LINK, EXDEV, 0, 1);
+    memory_storage_fail(MEMORY_FAULT_OPEN, EMFILE, 0, 1);
+    check(transfer_uploads() < 0, "migration stops when a report cannot be carried over");
+    
+    check(has_contents(REPORTING_DIR "/old_20240101.xml", kept, strlen(kept)),
+          "migration keeps a report it could not carry over");
+    check(has_contents(UPLOAD_DIR "/sales/sales_20240102.xml", report, strlen(report)),
+          "migration keeps the uploads when it stops");
+    
+    check(transfer_uploads() == 0, "migration succeeds on the next run");
+    
+    char path[512];
+    published_path("old_20240101.xml", path, sizeof(path));
+    int migrated = has_contents(path, kept, strlen(kept));
+    published_path("sales_20240102.xml", path, sizeof(path));
+    migrated &= has_contents(path, report, strlen(report));
+    check(migrated && storage->exists(REPORTING_DIR "/old_20240101.xml") != 0,
+          "migration moves the old reports into the first generation");
+    
+    // Published reports are shared between generations, so read-only
+    char snapshot[512];
+    struct storage_dir *dir = reporting_open_snapshot(snapshot, sizeof(snapshot));
+    struct storage_stat st;
+    int sealed = dir && storage->stat_at(dir, "old_20240101.xml", &st, STORAGE_STAT_MODE) == 0 &&
+                 (st.mode & 07777) == REPORT_MODE &&
+                 storage->stat_at(dir, "sales_20240102.xml", &st, STORAGE_STAT_MODE) == 0 &&
+                 (st.mode & 07777) == REPORT_MODE;
+    if (dir) {
+        storage->dir_close(dir);
+    }
+    check(sealed, "published reports are read-only");
+}
+
+// Publish one report, then fail a second transfer at the given fault and
+// check that nothing of either is lost
+static void check_second_run(int op, int err, unsigned after, const char *what) {
+    seed_tree();
+    
+    const char *first = "<report><date>20240101</date></report>\n";
+    put_upload("sales", "sales_20240101.xml", first, strlen(first));
+    transfer_uploads();
+    
+    const char *second = "<report><date>20240102</date></report>\n";
+    put_upload("sales", "sales_20240102.xml", second, strlen(second));
+    
+    if (op == MEMORY_FAULT_LINK) {
+        // Neither the hard link nor the fallback copy can be made
+        memory_storage_fail(MEMORY_FAULT_OPEN, EMFILE, 0, 1);
+    }
+    memory_storage_fail(op, err, after, 1);
+    
+    char label[128];
+    snprintf(label, sizeof(label), "%s fails the transfer", what);
+    check(transfer_uploads() < 0, label);
+    
+    char path[512];
+    published_path("sales_20240101.xml", path, sizeof(path));
+    snprintf(label, sizeof(label), "%s keeps the published report", what);
+    check(has_contents(path, first, strlen(first)), label);
+    
+    published_path("sales_20240102.xml", path, sizeof(path));
+    snprintf(label, sizeof(label), "%s publishes nothing new", what);
+    check(storage->exists(path) != 0 &&
+          storage->exists(REPORTING_DIR "/gen-000002") != 0 &&
+          storage->exists(REPORTING_DIR "/" REPORTING_CURRENT ".tmp") != 0, label);
+    
+    snprintf(label, sizeof(label), "%s keeps the upload", what);
+    check(has_contents(UPLOAD_DIR "/sales/sales_20240102.xml", second, strlen(second)), label);
+    
+    snprintf(label, sizeof(label), "%s indexes nothing", what);
+    check(index_entries("20240102") == 0, label);
+    
+    // The next run picks up where this one failed
+    check(transfer_uploads() == 0, "the next transfer succeeds");
+    published_path("sales_20240101.xml", path, sizeof(path));
+    int both = has_contents(path, first, strlen(first));
+    published_path("sales_20240102.xml", path, sizeof(path));
+    both &= has_contents(path, second, strlen(second));
+    snprintf(label, sizeof(label), "after %s both reports are published", what);
+    check(both && index_entries("20240102") == 1, label);
+}
+
+// Time repeated transfers of many small reports. Every round publishes
+// a new generation and reclaims the last, so later rounds only match the
+// first if removed files really are freed.
+static void bench_transfer(void) {
+    seed_tree();
+    
+    const char *report = "<report><date>20240101</date><author>bench</author></report>\n";
+    for (int round = 1; round <= BENCH_ROUNDS; round++) {
+        for (int i = 0; i < BENCH_FILES; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "sales_%06d.xml", i);
+            put_upload("sales", name, report, strlen(report));
+        }
+        
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        transfer_uploads();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        
+        if (round != 1 && round != BENCH_ROUNDS) {
+            continue;
+        }
+        
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        char label[64];
+        snprintf(label, sizeof(label), "transfer of %d reports, round %d", BENCH_FILES, round);
+        printf("%-60s %.1f ms (%.1f us/file)\n", label, ms, ms * 1e3 / BENCH_FILES);
+    }
+}
+
+// Exercise the file operations against the in-memory backend: the
+// normal transfer and backup, the ENOSPC, EIO and short-write paths,
+// and a transfer benchmark that leaves the disk out of the numbers
+int main(void) {
+    log_redirect(log_sink);
+    storage_use(&memory_storage);
+    
+    check_transfer();
+    check_fault(MEMORY_FAULT_WRITE, ENOSPC, 0, "ENOSPC on write");
+    check_fault(MEMORY_FAULT_READ, EIO, 0, "EIO on read");
+    check_fault(MEMORY_FAULT_CLOSE, EIO, 1, "EIO on closing the copy");
+    check_short_writes();
+    check_migration();
+    check_second_run(MEMORY_FAULT_RENAME, ENOSPC, 0, "ENOSPC on publish");
+    check_second_run(MEMORY_FAULT_LINK, EXDEV, 0, "failing to carry a report");
+    bench_transfer();
+    
+    memory_storage_reset();
+    
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    
+    printf("All checks passed (%d errors logged by injected faults)\n", logged_errors);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,834 @@
+#include "../include/company.h"
+#include <stdint.h>
+
+// Maximum number of files open at once
+#define MEMORY_MAX_FILES 64
+
+// File or directory held in memory. A removed node's path and data are
+// freed and its slot reused, unless a handle still has it open, in which
+// case that happens on the last close, as with an unlinked file.
+struct mem_node {
+    char *path;
+    int is_dir;
+    int is_link;   // Link target is held in data
+    int deleted;
+    int open_count;
+    int next_free;   // Next reusable slot while on the free list
+    char *data;
+    size_t size;
+    size_t cap;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t atime;
+    time_t mtime;
+};
+
+// Open directory for the in-memory backend
+struct storage_dir {
+    char path[512];
+    size_t pos;
+};
+
+// Open file handle
+struct mem_file {
+    int used;
+    int node;
+    size_t pos;
+    int append;
+};
+
+// Injected failure for one operation
+struct mem_fault {
+    int armed;
+    int err;
+    unsigned after;
+    unsigned times;   // 0 means fail until reset
+};
+
+// Slots in use are nodes[0..node_count), of which live_count are live
+// and the rest wait on the free list for reuse
+static struct mem_node *nodes = NULL;
+static size_t node_count = 0;
+static size_t node_cap = 0;
+static size_t live_count = 0;
+static int free_head = -1;
+
+// Open-addressing path index, each slot holds node index + 1 or 0.
+// Entries of removed nodes are left behind until the next rebuild and
+// never match, as lookups compare the path of a live node.
+static int *path_index = NULL;
+static size_t index_size = 0;
+static size_t index_used = 0;
+
+static struct mem_file files[MEMORY_MAX_FILES];
+static struct mem_fault faults[MEMORY_FAULT_COUNT];
+static size_t short_write_max = 0;
+
+// FNV-1a hash of a path
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Fail the call with the injected error if a fault is due
+static int fault(int op) {
+    struct mem_fault *f = &faults[op];
+    if (!f->armed) {
+        return 0;
+    }
+    
+    if (f->after > 0) {
+        f->after--;
+        return 0;
+    }
+    
+    if (f->times > 0 && --f->times == 0) {
+        f->armed = 0;
+    }
+    
+    errno = f->err;
+    return -1;
+}
+
+static void index_add(int n) {
+    size_t mask = index_size - 1;
+    size_t i = hash_path(nodes[n].path) & mask;
+    while (path_index[i]) {
+        i = (i + 1) & mask;
+    }
+    path_index[i] = n + 1;
+    index_used++;
+}
+
+// Rebuild the path index with room for at least twice the live nodes
+static int index_rebuild(size_t wanted) {
+    size_t size = 64;
+    while (size < wanted * 2) {
+        size *= 2;
+    }
+    
+    int *slots = calloc(size, sizeof(int));
+    if (!slots) {
+        return -1;
+    }
+    
+    free(path_index);
+    path_index = slots;
+    index_size = size;
+    index_used = 0;
+    
+    for (size_t n = 0; n < node_count; n++) {
+        if (!nodes[n].deleted) {
+            index_add(n);
+        }
+    }
+    
+    return 0;
+}
+
+static int find_node(const char *path) {
+    if (index_size == 0) {
+        return -1;
+    }
+    
+    size_t mask = index_size - 1;
+    size_t i = hash_path(path) & mask;
+    while (path_index[i]) {
+        int n = path_index[i] - 1;
+        if (!nodes[n].deleted && strcmp(nodes[n].path, path) == 0) {
+            return n;
+        }
+        i = (i + 1) & mask;
+    }
+    
+    return -1;
+}
+
+// Index a live node under its current path, rebuilding the index once
+// it is half full. A rebuild indexes every live node, n included.
+static int index_insert(int n) {
+    if ((index_used + 1) * 2 > index_size) {
+        if (index_rebuild(live_count * 2) < 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        return 0;
+    }
+    
+    index_add(n);
+    return 0;
+}
+
+// Free a removed node's memory and put its slot on the free list
+static void release_node(int n) {
+    struct mem_node *node = &nodes[n];
+    free(node->path);
+    free(node->data);
+    node->path = NULL;
+    node->data = NULL;
+    node->size = node->cap = 0;
+    node->next_free = free_head;
+    free_head = n;
+}
+
+static int add_node(const char *path, int is_dir, mode_t mode) {
+    char *copy = strdup(path);
+    if (!copy) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    int n;
+    if (free_head >= 0) {
+        n = free_head;
+        free_head = nodes[n].next_free;
+    } else {
+        if (node_count == node_cap) {
+            size_t cap = node_cap ? node_cap * 2 : 64;
+            struct mem_node *grown = realloc(nodes, cap * sizeof(struct mem_node));
+            if (!grown) {
+                free(copy);
+                errno = ENOSPC;
+                return -1;
+            }
+            nodes = grown;
+            node_cap = cap;
+        }
+        n = node_count++;
+    }
+    
+    struct mem_node *node = &nodes[n];
+    memset(node, 0, sizeof(struct mem_node));
+    node->path = copy;
+    node->is_dir = is_dir;
+    node->mode = mode & 07777;
+    node->uid = geteuid();
+    node->gid = getegid();
+    node->atime = node->mtime = time(NULL);
+    live_count++;
+    
+    if (index_insert(n) < 0) {
+        node->deleted = 1;
+        live_count--;
+        release_node(n);
+        return -1;
+    }
+    
+    return n;
+}
+
+static void remove_node(int n) {
+    nodes[n].deleted = 1;
+    live_count--;
+    
+    if (nodes[n].open_count == 0) {
+        release_node(n);
+    }
+}
+
+// Build the full path of an entry
+static void entry_path(struct storage_dir *dir, const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", dir->path, name);
+}
+
+static int find_entry(struct storage_dir *dir, const char *name) {
+    char path[1024];
+    entry_path(dir, name, path, sizeof(path));
+    
+    int n = find_node(path);
+    if (n < 0) {
+        errno = ENOENT;
+    }
+    return n;
+}
+
+static struct storage_dir *mem_dir_open(const char *path) {
+    if (fault(MEMORY_FAULT_DIR) < 0) {
+        return NULL;
+    }
+    
+    int n = find_node(path);
+    if (n < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    
+    if (!nodes[n].is_dir) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    
+    struct storage_dir *dir = malloc(sizeof(struct storage_dir));
+    if (!dir) {
+        return NULL;
+    }
+    
+    snprintf(dir->path, sizeof(dir->path), "%s", path);
+    dir->pos = 0;
+    return dir;
+}
+
+static int mem_dir_next(struct storage_dir *dir, struct storage_entry *entry) {
+    size_t len = strlen(dir->path);
+    
+    while (dir->pos < node_count) {
+        struct mem_node *node = &nodes[dir->pos++];
+        if (node->deleted ||
+            strncmp(node->path, dir->path, len) != 0 ||
+            node->path[len] != '/' ||
+            strchr(node->path + len + 1, '/') != NULL) {
+            continue;
+        }
+        
+        snprintf(entry->name, sizeof(entry->name), "%s", node->path + len + 1);
+        entry->type = node->is_dir ? STORAGE_DIR : node->is_link ? STORAGE_OTHER : STORAGE_FILE;
+        return 1;
+    }
+    
+    return 0;
+}
+
+static void mem_dir_close(struct storage_dir *dir) {
+    free(dir);
+}
+
+static int mem_mkdir(const char *path, mode_t mode) {
+    if (fault(MEMORY_FAULT_MKDIR) < 0) {
+        return -1;
+    }
+    
+    if (find_node(path) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    
+    return add_node(path, 1, mode) < 0 ? -1 : 0;
+}
+
+static int mem_rmdir(const char *path) {
+    int n = find_node(path);
+    if (n < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    if (!nodes[n].is_dir) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    
+    // Refuse while anything is left inside
+    size_t len = strlen(path);
+    for (size_t i = 0; i < node_count; i++) {
+        if (!nodes[i].deleted && strncmp(nodes[i].path, path, len) == 0 && nodes[i].path[len] == '/') {
+            errno = ENOTEMPTY;
+            return -1;
+        }
+    }
+    
+    remove_node(n);
+    return 0;
+}
+
+static int mem_chmod(const char *path, mode_t mode) {
+    if (fault(MEMORY_FAULT_CHMOD) < 0) {
+        return -1;
+    }
+    
+    int n = find_node(path);
+    if (n < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    nodes[n].mode = mode & 07777;
+    return 0;
+}
+
+static int mem_exists(const char *path) {
+    if (find_node(path) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+// Nothing outside this process can read the in-memory tree, so there
+// are never readers to wait for
+static int mem_dir_trylock(struct storage_dir *dir, int exclusive) {
+    (void)dir;
+    (void)exclusive;
+    return 0;
+}
+
+static int mem_stat_at(struct storage_dir *dir, const char *name, struct storage_stat *st, int want) {
+    (void)want;
+    
+    if (fault(MEMORY_FAULT_STAT) < 0) {
+        return -1;
+    }
+    
+    int n = find_entry(dir, name);
+    if (n < 0) {
+        return -1;
+    }
+    
+    struct mem_node *node = &nodes[n];
+    st->mode = node->mode | (node->is_dir ? S_IFDIR : node->is_link ? S_IFLNK : S_IFREG);
+    st->uid = node->uid;
+    st->gid = node->gid;
+    st->size = node->size;
+    st->atime = node->atime;
+    st->mtime = node->mtime;
+    return 0;
+}
+
+static int mem_open_at(struct storage_dir *dir, const char *name, int flags, mode_t mode) {
+    if (fault(MEMORY_FAULT_OPEN) < 0) {
+        return -1;
+    }
+    
+    int fd = 0;
+    while (fd < MEMORY_MAX_FILES && files[fd].used) {
+        fd++;
+    }
+    if (fd == MEMORY_MAX_FILES) {
+        errno = EMFILE;
+        return -1;
+    }
+    
+    char path[1024];
+    entry_path(dir, name, path, sizeof(path));
+    
+    int n = find_node(path);
+    if (n >= 0 && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        return -1;
+    }
+    
+    if (n < 0) {
+        if (!(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+        
+        n = add_node(path, 0, mode);
+        if (n < 0) {
+            return -1;
+        }
+    } else if (nodes[n].is_dir) {
+        errno = EISDIR;
+        return -1;
+    } else if (flags & O_TRUNC) {
+        nodes[n].size = 0;
+    }
+    
+    files[fd].used = 1;
+    files[fd].node = n;
+    nodes[n].open_count++;
+    files[fd].pos = 0;
+    files[fd].append = (flags & O_APPEND) != 0;
+    return fd;
+}
+
+static struct mem_file *get_file(int fd) {
+    if (fd < 0 || fd >= MEMORY_MAX_FILES || !files[fd].used) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &files[fd];
+}
+
+static ssize_t mem_read(int fd, void *buf, size_t len) {
+    if (fault(MEMORY_FAULT_READ) < 0) {
+        return -1;
+    }
+    
+    struct mem_file *file = get_file(fd);
+    if (!file) {
+        return -1;
+    }
+    
+    struct mem_node *node = &nodes[file->node];
+    if (file->pos >= node->size) {
+        return 0;
+    }
+    
+    if (len > node->size - file->pos) {
+        len = node->size - file->pos;
+    }
+    
+    memcpy(buf, node->data + file->pos, len);
+    file->pos += len;
+    node->atime = time(NULL);
+    return len;
+}
+
+static ssize_t mem_write(int fd, const void *buf, size_t len) {
+    if (fault(MEMORY_FAULT_WRITE) < 0) {
+        return -1;
+    }
+    
+    struct mem_file *file = get_file(fd);
+    if (!file) {
+        return -1;
+    }
+    
+    if (short_write_max > 0 && len > short_write_max) {
+        len = short_write_max;
+    }
+    
+    struct mem_node *node = &nodes[file->node];
+    if (file->append) {
+        file->pos = node->size;
+    }
+    
+    if (file->pos + len > node->cap) {
+        size_t cap = node->cap ? node->cap : 4096;
+        while (cap < file->pos + len) {
+            cap *= 2;
+        }
+        
+        char *grown = realloc(node->data, cap);
+        if (!grown) {
+            errno = ENOSPC;
+            return -1;
+        }
+        node->data = grown;
+        node->cap = cap;
+    }
+    
+    memcpy(node->data + file->pos, buf, len);
+    file->pos += len;
+    if (file->pos > node->size) {
+        node->size = file->pos;
+    }
+    node->mtime = time(NULL);
+    return len;
+}
+
+static int mem_close(int fd) {
+    struct mem_file *file = get_file(fd);
+    if (!file) {
+        return -1;
+    }
+    
+    // Like close(2), the handle is released even when an error is reported
+    file->used = 0;
+    
+    // The last handle on a removed file frees it
+    struct mem_node *node = &nodes[file->node];
+    if (--node->open_count == 0 && node->deleted) {
+        release_node(file->node);
+    }
+    
+    return fault(MEMORY_FAULT_CLOSE);
+}
+
+static int mem_chown_at(struct storage_dir *dir, const char *name, uid_t uid, gid_t gid) {
+    if (fault(MEMORY_FAULT_CHOWN) < 0) {
+        return -1;
+    }
+    
+    int n = find_entry(dir, name);
+    if (n < 0) {
+        return -1;
+    }
+    
+    nodes[n].uid = uid;
+    nodes[n].gid = gid;
+    return 0;
+}
+
+static int mem_chmod_at(struct storage_dir *dir, const char *name, mode_t mode) {
+    if (fault(MEMORY_FAULT_CHMOD) < 0) {
+        return -1;
+    }
+    
+    int n = find_entry(dir, name);
+    if (n < 0) {
+        return -1;
+    }
+    
+    nodes[n].mode = mode & 07777;
+    return 0;
+}
+
+static int mem_utime_at(struct storage_dir *dir, const char *name, time_t atime, time_t mtime) {
+    if (fault(MEMORY_FAULT_UTIME) < 0) {
+        return -1;
+    }
+    
+    int n = find_entry(dir, name);
+    if (n < 0) {
+        return -1;
+    }
+    
+    nodes[n].atime = atime;
+    nodes[n].mtime = mtime;
+    return 0;
+}
+
+static int mem_unlink_at(struct storage_dir *dir, const char *name) {
+    if (fault(MEMORY_FAULT_UNLINK) < 0) {
+        return -1;
+    }
+    
+    int n = find_entry(dir, name);
+    if (n < 0) {
+        return -1;
+    }
+    
+    if (nodes[n].is_dir) {
+        errno = EISDIR;
+        return -1;
+    }
+    
+    remove_node(n);
+    return 0;
+}
+
+// Hard links copy the data. Files are never modified in place once they
+// have been linked, so a copy cannot be told apart from a shared inode.
+static int mem_link_at(struct storage_dir *src_dir, const char *src_name,
+                       struct storage_dir *dst_dir, const char *dst_name) {
+    if (fault(MEMORY_FAULT_LINK) < 0) {
+        return -1;
+    }
+    
+    int src = find_entry(src_dir, src_name);
+    if (src < 0) {
+        return -1;
+    }
+    
+    if (nodes[src].is_dir) {
+        errno = EPERM;
+        return -1;
+    }
+    
+    char path[1024];
+    entry_path(dst_dir, dst_name, path, sizeof(path));
+    if (find_node(path) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    
+    char *data = NULL;
+    if (nodes[src].size > 0) {
+        data = malloc(nodes[src].size);
+        if (!data) {
+            errno = ENOSPC;
+            return -1;
+        }
+        memcpy(data, nodes[src].data, nodes[src].size);
+    }
+    
+    int dst = add_node(path, 0, 0);
+    if (dst < 0) {
+        free(data);
+        return -1;
+    }
+    
+    // add_node() may have moved the node array
+    struct mem_node *node = &nodes[dst];
+    const struct mem_node *orig = &nodes[src];
+    node->is_link = orig->is_link;
+    node->data = data;
+    node->size = node->cap = orig->size;
+    node->mode = orig->mode;
+    node->uid = orig->uid;
+    node->gid = orig->gid;
+    node->atime = orig->atime;
+    node->mtime = orig->mtime;
+    return 0;
+}
+
+static int mem_rename_at(struct storage_dir *src_dir, const char *src_name,
+                         struct storage_dir *dst_dir, const char *dst_name) {
+    if (fault(MEMORY_FAULT_RENAME) < 0) {
+        return -1;
+    }
+    
+    int src = find_entry(src_dir, src_name);
+    if (src < 0) {
+        return -1;
+    }
+    
+    if (nodes[src].is_dir) {
+        errno = EXDEV;   // Only entries are renamed, never whole trees
+        return -1;
+    }
+    
+    char path[1024];
+    entry_path(dst_dir, dst_name, path, sizeof(path));
+    char *new_path = strdup(path);
+    if (!new_path) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    // Replace the destination in one step, as rename(2) does
+    int dst = find_node(path);
+    if (dst >= 0) {
+        remove_node(dst);
+    }
+    
+    free(nodes[src].path);
+    nodes[src].path = new_path;
+    return index_insert(src);
+}
+
+static int mem_symlink_at(const char *target, struct storage_dir *dir, const char *name) {
+    char path[1024];
+    entry_path(dir, name, path, sizeof(path));
+    if (find_node(path) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    
+    char *data = strdup(target);
+    if (!data) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    int n = add_node(path, 0, 0777);
+    if (n < 0) {
+        free(data);
+        return -1;
+    }
+    
+    nodes[n].is_link = 1;
+    nodes[n].data = data;
+    nodes[n].size = nodes[n].cap = strlen(target);
+    return 0;
+}
+
+static ssize_t mem_readlink_at(struct storage_dir *dir, const char *name, char *buf, size_t size) {
+    int n = find_entry(dir, name);
+    if (n < 0) {
+        return -1;
+    }
+    
+    if (!nodes[n].is_link) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    size_t len = nodes[n].size;
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    memcpy(buf, nodes[n].data, len);
+    buf[len] = '\0';
+    return len;
+}
+
+// Drop every file and directory, open handle and injected fault
+void memory_storage_reset(void) {
+    for (size_t n = 0; n < node_count; n++) {
+        free(nodes[n].path);
+        free(nodes[n].data);
+    }
+    
+    free(nodes);
+    free(path_index);
+    nodes = NULL;
+    path_index = NULL;
+    node_count = node_cap = live_count = 0;
+    index_size = index_used = 0;
+    free_head = -1;
+    
+    memset(files, 0, sizeof(files));
+    memset(faults, 0, sizeof(faults));
+    short_write_max = 0;
+}
+
+// Create a file, and any missing parent directories, with the given contents
+int memory_storage_put(const char *path, const void *data, size_t len,
+                       uid_t uid, gid_t gid, time_t mtime) {
+    char parent[1024];
+    snprintf(parent, sizeof(parent), "%s", path);
+    
+    for (char *slash = strchr(parent + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (find_node(parent) < 0 && add_node(parent, 1, 0755) < 0) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    
+    int n = find_node(path);
+    if (n < 0) {
+        n = add_node(path, 0, 0644);
+        if (n < 0) {
+            return -1;
+        }
+    }
+    
+    struct mem_node *node = &nodes[n];
+    char *copy = malloc(len ? len : 1);
+    if (!copy) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    memcpy(copy, data, len);
+    free(node->data);
+    node->data = copy;
+    node->size = node->cap = len;
+    node->uid = uid;
+    node->gid = gid;
+    node->atime = node->mtime = mtime;
+    return 0;
+}
+
+// Make op fail with err once the next after calls have succeeded, for
+// times calls in a row (0 keeps failing until reset)
+void memory_storage_fail(int op, int err, unsigned after, unsigned times) {
+    if (op < 0 || op >= MEMORY_FAULT_COUNT) {
+        return;
+    }
+    
+    faults[op].armed = 1;
+    faults[op].err = err;
+    faults[op].after = after;
+    faults[op].times = times;
+}
+
+// Cap every write at max bytes (0 disables short writes)
+void memory_storage_short_writes(size_t max) {
+    short_write_max = max;
+}
+
+// In-memory backend
+const struct storage_ops memory_storage = {
+    .name = "memory",
+    .dir_open = mem_dir_open,
+    .dir_next = mem_dir_next,
+    .dir_close = mem_dir_close,
+    .mkdir = mem_mkdir,
+    .rmdir = mem_rmdir,
+    .chmod = mem_chmod,
+    .exists = mem_exists,
+    .dir_trylock = mem_dir_trylock,
+    .stat_at = mem_stat_at,
+    .open_at = mem_open_at,
+    .chown_at = mem_chown_at,
+    .chmod_at = mem_chmod_at,
+    .utime_at = mem_utime_at,
+    .unlink_at = mem_unlink_at,
+    .link_at = mem_link_at,
+    .rename_at = mem_rename_at,
+    .symlink_at = mem_symlink_at,
+    .readlink_at = mem_readlink_at,
+    .copy_at = NULL,
+    .read = mem_read,
+    .write = mem_write,
+    .close = mem_close,
+};
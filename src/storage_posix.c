@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include "../include/company.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+
+// Size of the buffer handed to each getdents64 call
+#define DENTS_BUFFER_SIZE 32768
+
+// Directory entry as returned by getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Open directory for the POSIX backend. Every per-entry operation is
+// made relative to fd, so the directory path is resolved only once.
+struct storage_dir {
+    int fd;
+    size_t pos;
+    size_t len;
+    char buf[DENTS_BUFFER_SIZE];
+};
+
+// Cleared when the kernel turns out not to support statx
+static int have_statx = 1;
+
+static struct storage_dir *posix_dir_open(const char *path) {
+    struct storage_dir *dir = malloc(sizeof(struct storage_dir));
+    if (!dir) {
+        return NULL;
+    }
+    
+    dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->fd < 0) {
+        int saved_errno = errno;
+        free(dir);
+        errno = saved_errno;
+        return NULL;
+    }
+    
+    dir->pos = dir->len = 0;
+    return dir;
+}
+
+static int posix_dir_next(struct storage_dir *dir, struct storage_entry *entry) {
+    while (1) {
+        // Refill the buffer with the next batch of entries
+        if (dir->pos >= dir->len) {
+            long n = syscall(SYS_getdents64, dir->fd, dir->buf, sizeof(dir->buf));
+            if (n < 0) {
+                return -1;
+            }
+            if (n == 0) {
+                return 0;
+            }
+            dir->pos = 0;
+            dir->len = n;
+        }
+        
+        struct linux_dirent64 *de = (struct linux_dirent64 *)(dir->buf + dir->pos);
+        dir->pos += de->d_reclen;
+        
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        
+        snprintf(entry->name, sizeof(entry->name), "%s", de->d_name);
+        switch (de->d_type) {
+            case DT_REG: entry->type = STORAGE_FILE; break;
+            case DT_DIR: entry->type = STORAGE_DIR; break;
+            case DT_LNK:
+            case DT_UNKNOWN: entry->type = STORAGE_UNKNOWN; break;
+            default: entry->type = STORAGE_OTHER; break;
+        }
+        return 1;
+    }
+}
+
+static void posix_dir_close(struct storage_dir *dir) {
+    close(dir->fd);
+    free(dir);
+}
+
+static int posix_mkdir(const char *path, mode_t mode) {
+    return mkdir(path, mode);
+}
+
+static int posix_rmdir(const char *path) {
+    return rmdir(path);
+}
+
+static int posix_chmod(const char *path, mode_t mode) {
+    return chmod(path, mode);
+}
+
+static int posix_exists(const char *path) {
+    return access(path, F_OK);
+}
+
+// Readers pin a generation with a shared flock() on its directory
+static int posix_dir_trylock(struct storage_dir *dir, int exclusive) {
+    return flock(dir->fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB);
+}
+
+// Stat an entry, asking statx only for the fields the caller needs
+static int posix_stat_at(struct storage_dir *dir, const char *name, struct storage_stat *st, int want) {
+    if (have_statx) {
+        unsigned int mask = STATX_TYPE;
+        if (want & STORAGE_STAT_MODE) {
+            mask |= STATX_MODE;
+        }
+        if (want & STORAGE_STAT_OWNER) {
+            mask |= STATX_UID | STATX_GID;
+        }
+        if (want & STORAGE_STAT_SIZE) {
+            mask |= STATX_SIZE;
+        }
+        if (want & STORAGE_STAT_TIMES) {
+            mask |= STATX_ATIME | STATX_MTIME;
+        }
+        
+        struct statx sx;
+        if (statx(dir->fd, name, AT_STATX_DONT_SYNC, mask, &sx) == 0) {
+            st->mode = sx.stx_mode;
+            st->uid = sx.stx_uid;
+            st->gid = sx.stx_gid;
+            st->size = sx.stx_size;
+            st->atime = sx.stx_atime.tv_sec;
+            st->mtime = sx.stx_mtime.tv_sec;
+            return 0;
+        }
+        
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        have_statx = 0;
+    }
+    
+    struct stat sb;
+    if (fstatat(dir->fd, name, &sb, 0) != 0) {
+        return -1;
+    }
+    
+    st->mode = sb.st_mode;
+    st->uid = sb.st_uid;
+    st->gid = sb.st_gid;
+    st->size = sb.st_size;
+    st->atime = sb.st_atime;
+    st->mtime = sb.st_mtime;
+    return 0;
+}
+
+static int posix_open_at(struct storage_dir *dir, const char *name, int flags, mode_t mode) {
+    return openat(dir->fd, name, flags | O_CLOEXEC, mode);
+}
+
+static int posix_chown_at(struct storage_dir *dir, const char *name, uid_t uid, gid_t gid) {
+    return fchownat(dir->fd, name, uid, gid, 0);
+}
+
+static int posix_chmod_at(struct storage_dir *dir, const char *name, mode_t mode) {
+    return fchmodat(dir->fd, name, mode, 0);
+}
+
+static int posix_utime_at(struct storage_dir *dir, const char *name, time_t atime, time_t mtime) {
+    struct timespec times[2];
+    times[0].tv_sec = atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    return utimensat(dir->fd, name, times, 0);
+}
+
+static int posix_unlink_at(struct storage_dir *dir, const char *name) {
+    return unlinkat(dir->fd, name, 0);
+}
+
+static int posix_link_at(struct storage_dir *src_dir, const char *src_name,
+                         struct storage_dir *dst_dir, const char *dst_name) {
+    return linkat(src_dir->fd, src_name, dst_dir->fd, dst_name, 0);
+}
+
+static int posix_rename_at(struct storage_dir *src_dir, const char *src_name,
+                           struct storage_dir *dst_dir, const char *dst_name) {
+    return renameat(src_dir->fd, src_name, dst_dir->fd, dst_name);
+}
+
+static int posix_symlink_at(const char *target, struct storage_dir *dir, const char *name) {
+    return symlinkat(target, dir->fd, name);
+}
+
+static ssize_t posix_readlink_at(struct storage_dir *dir, const char *name, char *buf, size_t size) {
+    ssize_t len = readlinkat(dir->fd, name, buf, size - 1);
+    if (len >= 0) {
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+// POSIX backend
+const struct storage_ops posix_storage = {
+    .name = "posix",
+    .dir_open = posix_dir_open,
+    .dir_next = posix_dir_next,
+    .dir_close = posix_dir_close,
+    .mkdir = posix_mkdir,
+    .rmdir = posix_rmdir,
+    .chmod = posix_chmod,
+    .exists = posix_exists,
+    .dir_trylock = posix_dir_trylock,
+    .stat_at = posix_stat_at,
+    .open_at = posix_open_at,
+    .chown_at = posix_chown_at,
+    .chmod_at = posix_chmod_at,
+    .utime_at = posix_utime_at,
+    .unlink_at = posix_unlink_at,
+    .link_at = posix_link_at,
+    .rename_at = posix_rename_at,
+    .symlink_at = posix_symlink_at,
+    .readlink_at = posix_readlink_at,
+    .copy_at = NULL,
+    .read = read,
+    .write = write,
+    .close = close,
+};
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include "../include/company.h"
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+// Nonzero while a traced session is running
+int trace_active = 0;
+
+// Every thread's buffer, pushed once when the thread first records
+static _Atomic(struct trace_buffer *) buffers = NULL;
+static __thread struct trace_buffer *local_buffer = NULL;
+
+static char session_name[64];
+static time_t session_started;
+static uint64_t session_start_us;
+
+// Monotonic time in microseconds, served from the vDSO without a system call
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Return the calling thread's buffer, allocating it on first use
+static struct trace_buffer *get_buffer(void) {
+    if (local_buffer) {
+        return local_buffer;
+    }
+    
+    struct trace_buffer *buffer = calloc(1, sizeof(struct trace_buffer));
+    if (!buffer) {
+        return NULL;
+    }
+    
+    buffer->tid = syscall(SYS_gettid);
+    buffer->next = atomic_load(&buffers);
+    while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer)) {
+        // buffer->next now holds the current head, try again
+    }
+    
+    local_buffer = buffer;
+    return buffer;
+}
+
+// Nonzero if the flag file asks for the upload monitor to be traced
+static int monitor_requested(void) {
+    char buf[64];
+    int fd = open(TRACE_FLAG, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    
+    buf[len] = '\0';
+    return strstr(buf, TRACE_MONITOR) != NULL;
+}
+
+// Start a traced session if tracing has been switched on. Returns 1 when
+// the session is being traced.
+int trace_session_begin(const char *name) {
+    if (access(TRACE_FLAG, F_OK) != 0) {
+        return 0;
+    }
+    
+    if (strcmp(name, TRACE_MONITOR) == 0 && !monitor_requested()) {
+        return 0;
+    }
+    
+    for (struct trace_buffer *buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        buffer->count = 0;
+        buffer->dropped = 0;
+        buffer->depth = 0;
+    }
+    
+    snprintf(session_name, sizeof(session_name), "%s", name);
+    session_started = time(NULL);
+    session_start_us = now_us();
+    trace_active = 1;
+    
+    log_message(LOG_INFO, "Tracing %s run", name);
+    return 1;
+}
+
+// Open a span on the calling thread
+void trace_begin(const char *cat, const char *name, const char *arg) {
+    if (!trace_active) {
+        return;
+    }
+    
+    struct trace_buffer *buffer = get_buffer();
+    if (!buffer) {
+        return;
+    }
+    
+    // Spans nested too deeply are counted so that trace_end() still pairs up
+    if (buffer->depth < TRACE_MAX_DEPTH) {
+        struct trace_open_span *span = &buffer->stack[buffer->depth];
+        span->cat = cat;
+        span->name = name;
+        snprintf(span->arg, sizeof(span->arg), "%s", arg ? arg : "");
+        span->start_us = now_us();
+    }
+    buffer->depth++;
+}
+
+// Close the innermost span on the calling thread
+void trace_end(void) {
+    struct trace_buffer *buffer = local_buffer;
+    if (!trace_active || !buffer || buffer->depth == 0) {
+        return;
+    }
+    
+    unsigned depth = --buffer->depth;
+    if (depth >= TRACE_MAX_DEPTH) {
+        return;
+    }
+    
+    if (buffer->count == TRACE_MAX_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+    
+    struct trace_open_span *span = &buffer->stack[depth];
+    struct trace_event *event = &buffer->events[buffer->count++];
+    event->cat = span->cat;
+    event->name = span->name;
+    event->start_us = span->start_us;
+    event->dur_us = now_us() - span->start_us;
+    memcpy(event->arg, span->arg, sizeof(event->arg));
+}
+
+// Write a string as a JSON string literal
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Trace file found while pruning
+struct trace_file {
+    char name[256];
+    time_t mtime;
+};
+
+static int compare_trace_files(const void *a, const void *b) {
+    const struct trace_file *fa = a;
+    const struct trace_file *fb = b;
+    if (fa->mtime != fb->mtime) {
+        return fa->mtime < fb->mtime ? -1 : 1;
+    }
+    return strcmp(fa->name, fb->name);
+}
+
+// Remove the oldest trace files so that at most TRACE_KEEP_FILES remain
+static void prune_traces(void) {
+    DIR *dir = opendir(TRACE_DIR);
+    if (!dir) {
+        return;
+    }
+    
+    struct trace_file *files = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "trace_", 6) != 0 || !strstr(entry->d_name, ".json")) {
+            continue;
+        }
+        
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) {
+            continue;
+        }
+        
+        if (count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            struct trace_file *grown = realloc(files, new_cap * sizeof(*files));
+            if (!grown) {
+                break;
+            }
+            files = grown;
+            cap = new_cap;
+        }
+        
+        snprintf(files[count].name, sizeof(files[count].name), "%s", entry->d_name);
+        files[count].mtime = st.st_mtime;
+        count++;
+    }
+    
+    if (count > TRACE_KEEP_FILES) {
+        qsort(files, count, sizeof(*files), compare_trace_files);
+        for (size_t i = 0; i < count - TRACE_KEEP_FILES; i++) {
+            unlinkat(dirfd(dir), files[i].name, 0);
+        }
+    }
+    
+    free(files);
+    closedir(dir);
+}
+
+// Finish the session and write its trace in Chrome trace-event format
+void trace_session_end(void) {
+    if (!trace_active) {
+        return;
+    }
+    
+    trace_active = 0;
+    
+    if (mkdir(TRACE_DIR, 0755) < 0 && errno != EEXIST) {
+        log_message(LOG_ERR, "Failed to create trace directory %s: %s", TRACE_DIR, strerror(errno));
+        return;
+    }
+    
+    char path[512];
+    snprintf(path, sizeof(path), "%s/trace_%s_%ld.json", TRACE_DIR, session_name, (long)session_started);
+    
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        log_message(LOG_ERR, "Failed to create trace file %s: %s", path, strerror(errno));
+        return;
+    }
+    
+    int pid = getpid();
+    unsigned total = 0;
+    unsigned dropped = 0;
+    
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"company_daemon %s\"}}",
+            pid, session_name);
+    
+    for (struct trace_buffer *buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        for (unsigned i = 0; i < buffer->count; i++) {
+            struct trace_event *event = &buffer->events[i];
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d",
+                    event->name, event->cat,
+                    (unsigned long long)(event->start_us - session_start_us),
+                    (unsigned long long)event->dur_us, pid, buffer->tid);
+            if (event->arg[0]) {
+                fprintf(f, ",\"args\":{\"target\":");
+                write_json_string(f, event->arg);
+                fputc('}', f);
+            }
+            fputc('}', f);
+        }
+        
+        total += buffer->count;
+        dropped += buffer->dropped;
+    }
+    
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    
+    if (fclose(f) != 0) {
+        log_message(LOG_ERR, "Failed to write trace file %s: %s", path, strerror(errno));
+        return;
+    }
+    
+    log_message(LOG_INFO, "Trace written to %s (%u events, %u dropped)", path, total, dropped);
+    prune_traces();
+}